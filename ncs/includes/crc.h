@@ -0,0 +1,35 @@
+/** @file crc.h
+ * @brief Table driven CRC kernels used to check the integrity of the frames
+ *
+ * @author Gonçalo Peralta & João Alvares
+ * @date 17 October 2026
+ * @bug No known bugs.
+*/
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+
+/**
+ * @brief Computes the CRC-16/CCITT-FALSE of a buffer
+ * 
+ * Polynomial 0x1021, initial value 0xFFFF, no reflection and no final XOR ("123456789" gives 0x29B1).
+ * One 256 entry table lookup per byte.
+ * @param[in] buf buffer with the bytes
+ * @param[in] nbytes number of bytes of buf
+ * @return the CRC
+*/
+uint16_t calcCrc16(const uint8_t *buf, int nbytes);
+
+/**
+ * @brief Computes the CRC-32 (IEEE 802.3) of a buffer
+ * 
+ * Reflected polynomial 0xEDB88320, initial value and final XOR 0xFFFFFFFF ("123456789" gives 0xCBF43926).
+ * One 256 entry table lookup per byte, the same kernel on the target and in the host tests.
+ * @param[in] buf buffer with the bytes
+ * @param[in] nbytes number of bytes of buf
+ * @return the CRC
+*/
+uint32_t calcCrc32(const uint8_t *buf, int nbytes);
+
+#endif
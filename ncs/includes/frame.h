@@ -0,0 +1,152 @@
+/** @file frame.h
+ * @brief Streaming decoder that extracts command frames from the received UART bytes
+ *
+ * Bytes are consumed one at a time as they arrive (UART callback) and every complete
+ * "# ... !" frame (or binary "SYNC LEN ... CRC" frame when enabled) is handed to the
+ * command stage through a single producer / single consumer ring buffer. The same ring
+ * holds the response frames until the UART has sent them.
+ *
+ * @author Gonçalo Peralta & João Alvares
+ * @date 17 October 2026
+ * @bug No known bugs.
+*/
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+#include "cmdproc.h"
+
+#define FRAME_MAX_LEN UART_RX_SIZE	/**< Maximum size of a frame, including the NULL terminator */
+#define FRAME_QUEUE_LEN 4			/**< Number of frames the queue can hold (power of 2) */
+#define FRAME_QUEUE_HIGH (FRAME_QUEUE_LEN-1)	/**< Level at which the sender is asked to stop */
+#define FRAME_QUEUE_LOW 1			/**< Level at which the sender is allowed again */
+
+#define FRAME_IDLE 0		/**< Decoder waiting for a SOF_SYM or a BIN_SYNC */
+#define FRAME_BODY 1		/**< Decoder storing the bytes of an ASCII frame */
+#define FRAME_BIN_LEN 2		/**< Decoder waiting for the LEN byte of a binary frame */
+#define FRAME_BIN_BODY 3	/**< Decoder storing the bytes of a binary frame */
+
+/**
+ * @brief State of the byte-at-a-time frame decoder
+*/
+typedef struct{
+    int state;                  /**< FRAME_IDLE, FRAME_BODY, FRAME_BIN_LEN or FRAME_BIN_BODY */
+    int len;                    /**< Number of bytes stored in buf */
+    int need;                   /**< Bytes still missing from the binary frame */
+    CmdLink *link;              /**< Link whose mode and check define the accepted frames, its RX counters are updated */
+    char buf[FRAME_MAX_LEN];    /**< Frame being received */
+} FrameDecoder;
+
+/**
+ * @brief Ring buffer of complete frames
+ *
+ * head is only written by the producer (UART callback) and tail only by the consumer (command thread).
+*/
+typedef struct{
+    struct{
+        int len;                /**< Number of bytes of the frame */
+        char buf[FRAME_MAX_LEN];/**< Frame followed by a NULL terminator */
+    } frame[FRAME_QUEUE_LEN];
+    unsigned int head;                          /**< Free running write index */
+    unsigned int tail;                          /**< Free running read index */
+    unsigned int dropped;                       /**< Frames dropped because the queue was full */
+} FrameQueue;
+
+/**
+ * @brief Initializes the decoder and waits for a SOF_SYM
+ *
+ * BIN_SYNC only starts a frame while the link is in CMD_MODE_BIN and the CRC size of the binary frames follows the link check.
+ * @param[in] dec pointer to the decoder
+ * @param[in] link link the bytes are received on
+ * @return void
+*/
+void frameDecoderInit(FrameDecoder *dec, CmdLink *link);
+
+/**
+ * @brief Initializes an empty frame queue
+ *
+ * @param[in] q pointer to the queue
+ * @return void
+*/
+void frameQueueInit(FrameQueue *q);
+
+/**
+ * @brief Feeds received bytes to the decoder and queues every complete frame
+ *
+ * A SOF_SYM (or BIN_SYNC in binary mode) outside a binary frame always restarts the frame, an ASCII
+ * frame longer than FRAME_MAX_LEN and a binary LEN above BIN_MAX_LEN are discarded, so the decoder
+ * resyncs on garbage after at most FRAME_MAX_LEN bytes.
+ *
+ * @param[in] dec pointer to the decoder
+ * @param[in] q queue where the complete frames are stored
+ * @param[in] data received bytes
+ * @param[in] len number of bytes in data
+ * CMD_STAT_RX_BYTES, CMD_STAT_FRAMES and CMD_STAT_RX_DROP of the link are updated.
+ * @return number of frames queued
+*/
+int frameFeed(FrameDecoder *dec, FrameQueue *q, const uint8_t *data, int len);
+
+/**
+ * @brief Gives the next free slot so a frame can be written in place
+ *
+ * The frame is only seen by the consumer after frameQueueCommit(), a slot that is not committed is reused by the next reserve.
+ * @param[in] q pointer to the queue
+ * @return pointer to a buffer of FRAME_MAX_LEN bytes, NULL if the queue is full (counted in dropped)
+*/
+char *frameQueueReserve(FrameQueue *q);
+
+/**
+ * @brief Publishes the frame written in the slot returned by frameQueueReserve()
+ *
+ * @param[in] q pointer to the queue
+ * @param[in] len number of bytes of the frame
+ * @return void
+*/
+void frameQueueCommit(FrameQueue *q, int len);
+
+/**
+ * @brief Copies a frame to the queue
+ *
+ * @param[in] q pointer to the queue
+ * @param[in] frame bytes of the frame
+ * @param[in] len number of bytes in frame, at most FRAME_MAX_LEN-1
+ * @return 1 if the frame was queued, 0 if the queue is full (counted in dropped)
+*/
+int frameQueuePush(FrameQueue *q, const char *frame, int len);
+
+/**
+ * @brief Takes the oldest frame from the queue
+ *
+ * @param[in] q pointer to the queue
+ * @param[out] frame buffer with at least FRAME_MAX_LEN bytes for the NULL terminated frame
+ * @return number of bytes of the frame, 0 if the queue is empty
+*/
+int frameQueuePop(FrameQueue *q, char *frame);
+
+/**
+ * @brief Number of frames in the queue, used for the flow control of the sender
+ *
+ * @param[in] q pointer to the queue
+ * @return number of queued frames (0 to FRAME_QUEUE_LEN)
+*/
+int frameQueueLevel(FrameQueue *q);
+
+/**
+ * @brief Gives the oldest frame without removing it, so it can be used in place (e.g. by a DMA transfer)
+ *
+ * @param[in] q pointer to the queue
+ * @param[out] len number of bytes of the frame
+ * @return pointer to the frame, NULL if the queue is empty
+*/
+const char *frameQueuePeek(FrameQueue *q, int *len);
+
+/**
+ * @brief Removes the frame returned by frameQueuePeek() so its slot can be reused
+ *
+ * @param[in] q pointer to the queue
+ * @return void
+*/
+void frameQueueRelease(FrameQueue *q);
+
+#endif
@@ -8,18 +8,223 @@
 #ifndef FUNCS_H
 #define FUNCS_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __ZEPHYR__
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#define RTDB_LOCK() k_sched_lock()      /**< Writers are not preempted by other threads (uniprocessor) */
+#define RTDB_UNLOCK() k_sched_unlock()
+#else
+#define RTDB_LOCK()
+#define RTDB_UNLOCK()
+
+/* Host builds (unit tests) use the compiler builtins behind the Zephyr atomic API */
+typedef long atomic_t;
+static inline long atomic_get(const atomic_t *target){ return __atomic_load_n(target, __ATOMIC_SEQ_CST); }
+static inline long atomic_set(atomic_t *target, long value){ return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST); }
+static inline long atomic_xor(atomic_t *target, long value){ return __atomic_fetch_xor(target, value, __ATOMIC_SEQ_CST); }
+static inline long atomic_and(atomic_t *target, long value){ return __atomic_fetch_and(target, value, __ATOMIC_SEQ_CST); }
+static inline long atomic_or(atomic_t *target, long value){ return __atomic_fetch_or(target, value, __ATOMIC_SEQ_CST); }
+#endif
+
+#define AN_MODE_SINGLE 0    /**< Analog input read once per RTDB refresh */
+#define AN_MODE_CONT 1      /**< Analog input sampled continuously at anFreq */
+#define AN_FREQ_DEFAULT 100 /**< Default continuous sampling frequency in Hz */
+#define AN_FREQ_MAX 9999    /**< Maximum continuous sampling frequency in Hz */
+#define BAUD_TIMEOUT_MS 2000    /**< Time a new baud rate has to receive a valid frame before the old one is restored */
+#define RTDB_BUT_SHIFT 4        /**< Position of button 1 in RTDB io, the LEDs use the bits below it */
+#define HIST_SIZE 20            /**< Number of analog samples kept in the RTDB history */
+#define RTDB_GRP_BUT 0          /**< Version group of the buttons */
+#define RTDB_GRP_LED 1          /**< Version group of the LEDs */
+#define RTDB_GRP_AN 2           /**< Version group of the analog input */
+#define RTDB_GRP_N 3            /**< Number of version groups */
+#define RTDB_GEN_MOD 1000000000 /**< Generations wrap to 1 at this value (9 digits) */
+
+#define SIG_DIN 0   /**< Digital input, read only bit of RTDB io */
+#define SIG_DOUT 1  /**< Digital output, bit of RTDB io */
+#define SIG_AN 2    /**< Analog input, read only anRaw */
+
+/**
+ * @brief Signals of the RTDB, one X(name, kind, bit, alias) line each
+ * 
+ * The list order gives the numeric ID used by the 'I' command (SIG_name), kind is SIG_DIN, SIG_DOUT or SIG_AN, bit is the
+ * position in RTDB io of a digital signal and alias is the devicetree alias of its GPIO (none for the analog input).
+ * Each user expands the list into the table it needs and the io masks are derived from it, so a new signal is a single
+ * line here: a button at RTDB_BUT_SHIFT+n, a LED below RTDB_BUT_SHIFT (raise it for a fifth LED, the checks below fail
+ * otherwise). 'I' reaches every signal, the 'B' response and the 'D' groups only show the first 4 buttons and LEDs.
+*/
+#define RTDB_SIGNALS(X) \
+    X(BUT1, SIG_DIN, RTDB_BUT_SHIFT+0, sw0) \
+    X(BUT2, SIG_DIN, RTDB_BUT_SHIFT+1, sw1) \
+    X(BUT3, SIG_DIN, RTDB_BUT_SHIFT+2, sw2) \
+    X(BUT4, SIG_DIN, RTDB_BUT_SHIFT+3, sw3) \
+    X(LED1, SIG_DOUT, 0, led0) \
+    X(LED2, SIG_DOUT, 1, led1) \
+    X(LED3, SIG_DOUT, 2, led2) \
+    X(LED4, SIG_DOUT, 3, led3) \
+    X(AN1, SIG_AN, 0, none)
+
+#define RTDB_SIG_ID(name, kind, bit, alias) SIG_##name,
+enum{
+    RTDB_SIGNALS(RTDB_SIG_ID)
+    SIG_N   /**< Number of signals */
+};
+#undef RTDB_SIG_ID
+
+#define RTDB_SIG_DIN_BIT(name, kind, bit, alias) | ((kind) == SIG_DIN ? 1L << (bit) : 0)
+#define RTDB_SIG_DOUT_BIT(name, kind, bit, alias) | ((kind) == SIG_DOUT ? 1L << (bit) : 0)
+#define RTDB_BUT_MASK (0 RTDB_SIGNALS(RTDB_SIG_DIN_BIT))    /**< Bits of RTDB io holding the buttons (SIG_DIN signals) */
+#define RTDB_LED_MASK (0 RTDB_SIGNALS(RTDB_SIG_DOUT_BIT))   /**< Bits of RTDB io holding the LEDs (SIG_DOUT signals) */
+
+_Static_assert(RTDB_LED_MASK < (1L << RTDB_BUT_SHIFT), "A LED bit overlaps the buttons, raise RTDB_BUT_SHIFT");
+_Static_assert((RTDB_BUT_MASK & ((1L << RTDB_BUT_SHIFT) - 1)) == 0, "A button bit is below RTDB_BUT_SHIFT");
+_Static_assert(RTDB_LED_MASK <= 0xFF, "The LEDs no longer fit StoreCfg leds");
+
+/**
+ * @brief Analog sample of the RTDB history
+*/
+typedef struct{
+    uint32_t time;  /**< Kernel uptime of the sample in ms */
+    int16_t value;  /**< anRaw at that time */
+} RtdbSample;
+
 /**
  * @brief Real-time database
  * 
  * This database holds the LED and button states and the analog reader value.
+ * Writers update it between rtdbWriteBegin() and rtdbWriteEnd(), readers take a consistent copy with rtdbRead()
+ * without blocking them (sequence lock). io and anRaw are single words accessed on their own.
+ * Fields are ordered by size so the refreshed part fits in 32 bytes (a single cache line or a couple of bus bursts),
+ * the versions and the history follow it and have their own single writer protocol (rtdbTouch(), rtdbHistPush() and rtdbHistRead()).
 */
 typedef struct{
-    int led[4];    /**< LEDs 1 to 4 state (1 for ON and 0 for OFF)*/
-    int but[4];    /**< Button 1 to 4 state (1 for pressed and 0 for not pressed)*/
-    int anRaw;     /**< Raw value of the analog reader (0 to 1024 assuming 10 bits)*/
-    float anVal;   /**< Converted value of the analog reader (0V to 3V)*/
+    unsigned int seq;   /**< Sequence counter, odd while a writer is updating the RTDB*/
+    atomic_t io;        /**< LEDs (RTDB_LED_MASK, bit i-1 set for ON) and buttons (RTDB_BUT_MASK, bit set for pressed), changed with single atomic operations outside the write sections*/
+    int32_t jitLast;    /**< Delay of the start of the last refresh after its deadline in us*/
+    int32_t jitMax;     /**< Largest jitLast since the last 'T' command in us*/
+    int16_t anRaw;      /**< Raw value of the analog reader (0 to 1024 assuming 10 bits, anRaw*3/1024 V)*/
+    uint16_t anFreq;    /**< Sampling frequency of the analog input in AN_MODE_CONT (1 to AN_FREQ_MAX Hz)*/
+    uint8_t anMode;     /**< Analog reading mode, AN_MODE_SINGLE or AN_MODE_CONT*/
+    uint32_t gen;       /**< Generation, incremented by every rtdbTouch()*/
+    uint32_t ver[RTDB_GRP_N];   /**< Generation of the last change of each RTDB_GRP_* group, read with 'D'*/
+    struct{
+        unsigned int head;              /**< Free running index of the next sample, only written by the history writer (see rtdbHistPush()) */
+        RtdbSample sample[HIST_SIZE];   /**< Ring of the last HIST_SIZE samples */
+    } hist;             /**< History of anRaw, one sample per refresh (AN_MODE_SINGLE) or per ADC sample (AN_MODE_CONT), not copied by rtdbRead()*/
 } RTDB;
 
+_Static_assert(offsetof(RTDB, gen) <= 32, "Refreshed part of the RTDB no longer fits in 32 bytes");
+
+/**
+ * @brief Starts an update of the RTDB
+ * 
+ * Other writers are held off until rtdbWriteEnd(), the section should only hold the stores.
+ * 
+ * @param[in] rtdb pointer to the RTDB
+ * @return void
+*/
+static inline void rtdbWriteBegin(RTDB *rtdb){
+    RTDB_LOCK();
+    __atomic_store_n(&rtdb->seq, rtdb->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);    // seq is odd before any field changes
+}
+
+/**
+ * @brief Publishes the update started by rtdbWriteBegin()
+ * 
+ * @param[in] rtdb pointer to the RTDB
+ * @return void
+*/
+static inline void rtdbWriteEnd(RTDB *rtdb){
+    __atomic_store_n(&rtdb->seq, rtdb->seq + 1, __ATOMIC_RELEASE);
+    RTDB_UNLOCK();
+}
+
+/**
+ * @brief Copies a consistent snapshot of the RTDB, never blocks the writers
+ * 
+ * The history is not copied, see rtdbHistRead().
+ * @param[in] rtdb pointer to the RTDB
+ * @param[out] copy snapshot
+ * @return void
+*/
+static inline void rtdbRead(const RTDB *rtdb, RTDB *copy){
+    unsigned int seq;
+
+    do{
+        seq = __atomic_load_n(&rtdb->seq, __ATOMIC_ACQUIRE);
+        memcpy(copy, rtdb, offsetof(RTDB, hist));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((seq & 1) || __atomic_load_n(&rtdb->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/**
+ * @brief Records a change of a group in a new generation
+ * 
+ * Called after the change is stored, there must be a single writer (thread0). When gen wraps every version is restamped
+ * with the new generation, otherwise a group idle since before the wrap would stay above every client generation.
+ * @param[in] rtdb pointer to the RTDB
+ * @param[in] grp RTDB_GRP_* group that changed
+ * @return void
+*/
+static inline void rtdbTouch(RTDB *rtdb, int grp){
+    uint32_t gen = rtdb->gen + 1 == RTDB_GEN_MOD ? 1 : rtdb->gen + 1;
+
+    if(gen == 1){   // Wrapped, clients ahead of gen get every group once
+        for(int g = 0; g < RTDB_GRP_N; g++){
+            __atomic_store_n(&rtdb->ver[g], gen, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&rtdb->ver[grp], gen, __ATOMIC_RELAXED);
+    __atomic_store_n(&rtdb->gen, gen, __ATOMIC_RELEASE);   // Readers that see gen see the change and ver too
+}
+
+/**
+ * @brief Appends a sample to the history, overwriting the oldest one
+ * 
+ * Lock free, there must be a single writer: thread0 in AN_MODE_SINGLE, the ADC callback of the continuous sequence of
+ * thread2 while thread0 has handed the ADC over to it.
+ * @param[in] rtdb pointer to the RTDB
+ * @param[in] time kernel uptime of the sample in ms
+ * @param[in] value analog value
+ * @return void
+*/
+static inline void rtdbHistPush(RTDB *rtdb, uint32_t time, int16_t value){
+    unsigned int head = rtdb->hist.head;
+
+    rtdb->hist.sample[head % HIST_SIZE].time = time;
+    rtdb->hist.sample[head % HIST_SIZE].value = value;
+    __atomic_store_n(&rtdb->hist.head, head + 1, __ATOMIC_RELEASE);    // Sample is written before it is published
+}
+
+/**
+ * @brief Copies samples of the history, oldest first, never blocks the writer
+ * 
+ * @param[in] rtdb pointer to the RTDB
+ * @param[out] out buffer for n samples
+ * @param[in] n number of samples wanted
+ * @param[in] skip number of newest samples left out, n + skip below HIST_SIZE (the slot being rewritten is never read)
+ * @return number of samples copied, fewer than n until n + skip samples were pushed
+*/
+static inline int rtdbHistRead(const RTDB *rtdb, RtdbSample *out, int n, int skip){
+    unsigned int head;
+    int cnt;
+
+    do{
+        head = __atomic_load_n(&rtdb->hist.head, __ATOMIC_ACQUIRE);
+        cnt = head < (unsigned int)skip ? 0 : head - skip < (unsigned int)n ? (int)(head - skip) : n;
+        for(int i = 0; i < cnt; i++){
+            out[i] = rtdb->hist.sample[(head - skip - cnt + i) % HIST_SIZE];
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while(__atomic_load_n(&rtdb->hist.head, __ATOMIC_RELAXED) - head >= (unsigned int)(HIST_SIZE - skip - cnt));  // Oldest copied slot may have been rewritten
+
+    return cnt;
+}
+
 /**
  * @brief Initilizes the database with zeros
  * 
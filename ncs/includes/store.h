@@ -0,0 +1,68 @@
+/** @file store.h
+ * @brief Persistent configuration kept in flash with the Zephyr settings subsystem (NVS backend)
+ *
+ * The LED outputs, the RTDB refresh period and the analog sampling parameters are restored at boot,
+ * so the device serves the last configuration without the host replaying it. Changes are coalesced:
+ * at most one flash write every STORE_DELAY_MS, and only when the values differ from the stored ones.
+ *
+ * @author Gonçalo Peralta & João Alvares
+ * @date 17 October 2026
+ * @bug No known bugs.
+*/
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+
+#define STORE_KEY "ncs/cfg"     /**< Settings key of the configuration */
+#define STORE_DELAY_MS 5000     /**< Changes within this time share one flash write */
+
+/**
+ * @brief Configuration stored in flash
+ *
+ * New parameters are appended at the end, a shorter record written by an older firmware still loads.
+*/
+typedef struct{
+    int32_t period;     /**< RTDB refresh period in us (see updateFreq()) */
+    uint16_t anFreq;    /**< Continuous sampling frequency in Hz (1 to AN_FREQ_MAX) */
+    uint8_t anMode;     /**< AN_MODE_SINGLE or AN_MODE_CONT */
+    uint8_t leds;       /**< LED outputs, bit i-1 set for LED i ON */
+} StoreCfg;
+
+/**
+ * @brief Copies a stored record over the current configuration
+ *
+ * Fields missing from a shorter record keep their value, a record with a value out of range is ignored.
+ * @param[in,out] cfg configuration, holds the defaults on entry
+ * @param[in] data stored record
+ * @param[in] len number of bytes of the record
+ * @return 1 if the record was applied, 0 if it was ignored
+*/
+int storeCfgLoad(StoreCfg *cfg, const void *data, int len);
+
+/**
+ * @brief Loads the stored configuration, called once at boot before the first RTDB refresh
+ *
+ * @param[in,out] cfg configuration, holds the defaults on entry and the stored values on return
+ * @return 0 or the negative error of the settings subsystem (cfg then keeps the defaults)
+*/
+int storeInit(StoreCfg *cfg);
+
+/**
+ * @brief Schedules the write of a configuration
+ *
+ * Cheap when nothing changed, so it can be called after every RTDB refresh. A write already scheduled keeps its
+ * deadline and stores the latest values.
+ * @param[in] cfg current configuration
+ * @return void
+*/
+void storeSave(const StoreCfg *cfg);
+
+/**
+ * @brief Number of configuration writes to flash since boot
+ *
+ * @return writes done by the coalescing work item
+*/
+int storeWrites(void);
+
+#endif
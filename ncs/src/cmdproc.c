@@ -1,6 +1,6 @@
 /** @file cmdproc.c
  * @brief Definition of the function for the Command Processor module
- * 
+ *
  * @author Gonçalo Peralta & João Alvares
  * @date 03 June 2024
  * @bug No known bugs.
@@ -14,134 +14,882 @@
 #include <zephyr/drivers/uart.h>
 #include <zephyr/devicetree.h>
 #include <zephyr/drivers/adc.h>
-#include <stdio.h>
-#include <ctype.h>
-#include <stdlib.h>
 #include <string.h>
-#include <math.h>
 #include "../includes/cmdproc.h"
 #include "../includes/funcs.h"
+#include "../includes/crc.h"
 
 extern struct k_mutex test_mutex;
 
+static CmdLink legacyLink;	// Link used by cmdProcessor(), zero initialized so it uses CMD_CHECK_SUM
 
-int cmdProcessor(char *cmd, char *resp, RTDB *database){
-	unsigned char expectedChecksum = 0;
-	char receivedChecksum[4], checksum[4];
-	int var = 0;
-
-	switch(cmd[1]){
-		case 'B': // # B [CS] ! - Read button state, resp: # b [0/0/0/0] [CS] !
-			// Validate frame structure
-			if(cmd[5] != EOF_SYM){
-				return MISSING_EOF;
-			}
-			
-			// Validate checksum
-			expectedChecksum = calcChecksum(&(cmd[1]), 1);
-			sprintf(receivedChecksum, "%c%c%c", cmd[2], cmd[3], cmd[4]);
-			if(atoi(receivedChecksum) != expectedChecksum){
-				return WRONG_CS;
-			}
-			
-			// Response Command
-			k_mutex_lock(&test_mutex, K_FOREVER); 	// A Reading of the RTDB is about to begin lets lock the access
-			
-			sprintf(resp, "b%d%d%d%d", database->but[0], database->but[1], database->but[2], database->but[3]);
-			sprintf(checksum, "%03d", calcChecksum((unsigned char*)&(resp[0]), 5));
-			sprintf(resp, "#b%d%d%d%d%s!", database->but[0], database->but[1], database->but[2], database->but[3], checksum);
-			
-			k_mutex_unlock(&test_mutex);			// Reading done, time to unlock
-			
-			return SUCCESS;	// case 'B'
-		case 'L': // # L [1/2/3/4] [CS] ! - Toggle LED state (Ligado ou desligado)
-			// Validate frame structure
-			if(cmd[6] != EOF_SYM){
-				return MISSING_EOF;
-			}
+// # B [CS] ! - Read button state, resp: # b [0/0/0/0] [CS] !
+static int cmdButtons(CmdLink *link, const int *arg, int *res, RTDB *database){
+	res[0] = (atomic_get(&database->io) & RTDB_BUT_MASK) >> RTDB_BUT_SHIFT;	// Single load, same bit order as the response
 
-			// Validate LED number (1 to 4)
-			if(cmd[2] < '1' || cmd[2] > '4'){
-				return UNKNOWN_LED;
-			}
-			
-			// Validate checksum
-			expectedChecksum = calcChecksum(&(cmd[1]), 2);
-			sprintf(receivedChecksum, "%c%c%c", cmd[3], cmd[4], cmd[5]);
-			if(atoi(receivedChecksum) != expectedChecksum){
-				return WRONG_CS;
-			}
+	return SUCCESS;
+}
+
+// LED number (1 to 4)
+static int ledValidate(const int *arg){
+	return arg[0] < 1 || arg[0] > 4 ? UNKNOWN_LED : SUCCESS;
+}
+
+// # L [1/2/3/4] [CS] ! - Toggle LED state (Ligado ou desligado)
+static int cmdLed(CmdLink *link, const int *arg, int *res, RTDB *database){
+	long bit = 1L << (arg[0]-1);
 
-			// Toggle LED
-			k_mutex_lock(&test_mutex, K_FOREVER);
+	res[1] = !((atomic_xor(&database->io, bit) & bit));	// New state is the inverse of the old one
 
-			database->led[cmd[2]-1-'0'] = database->led[cmd[2]-1-'0'] == 1 ? 0 : 1;
-			var = database->led[cmd[2]-1-'0'];
-			
-			k_mutex_unlock(&test_mutex);
+	res[0] = arg[0];
+	return SUCCESS;
+}
 
-			// Response Command
-			sprintf(resp, "l%c%d", cmd[2], var);
-			sprintf(checksum, "%03d", calcChecksum((unsigned char*)&(resp[0]), 3));
-			sprintf(resp, "#l%c%d%s!", cmd[2], var, checksum);
+// # A [CS] ! - Read Analog sensor (Temperatura)
+static int cmdAnalog(CmdLink *link, const int *arg, int *res, RTDB *database){
+	res[0] = __atomic_load_n(&database->anRaw, __ATOMIC_RELAXED);	// Single word, no snapshot needed
 
-			return SUCCESS;	// case 'L'
-		case 'A': // # A [CS] ! - Read Analog sensor (Temperatura)
-			// Validate frame structure
-			if(cmd[5] != EOF_SYM){
-				return MISSING_EOF;
-			}
-			
-			// Validate checksum
-			expectedChecksum = calcChecksum(&(cmd[1]), 1);
-			sprintf(receivedChecksum, "%c%c%c", cmd[2], cmd[3], cmd[4]);
-			if(atoi(receivedChecksum) != expectedChecksum){
-				return WRONG_CS;
+	return SUCCESS;
+}
+
+// Refresh period (1 to 99 s), 0 would make the refresh thread spin
+static int periodValidate(const int *arg){
+	return arg[0] < 1 ? INVALID_FREQ : SUCCESS;
+}
+
+// # U [00] [CS] ! - Change frequecy of update of the in/out digital signals of RTDB
+static int cmdPeriod(CmdLink *link, const int *arg, int *res, RTDB *database){
+	updateFreq(arg[0]*1000000); // New frequecy of update
+	res[0] = arg[0];
+
+	return SUCCESS;
+}
+
+// Baud rates the UART can switch to
+static int baudValidate(const int *arg){
+	static const int rates[] = {9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1000000};
+
+	for(int i = 0; i < sizeof(rates)/sizeof(rates[0]); i++){
+		if(arg[0] == rates[i]){
+			return SUCCESS;
+		}
+	}
+
+	return INVALID_ARG;
+}
+
+// # R [bbbbbbb] [CS] ! - Switch the UART baud rate once the response is sent
+static int cmdBaud(CmdLink *link, const int *arg, int *res, RTDB *database){
+	link->baud = arg[0];	// Applied by the port, restored if no valid frame arrives at the new rate
+	res[0] = arg[0];
+
+	return SUCCESS;
+}
+
+// First counter of the page
+static int statValidate(const int *arg){
+	return arg[0] >= CMD_STAT_N ? INVALID_ARG : SUCCESS;
+}
+
+// # Q [ii] [CS] ! - Read three link counters starting at ii
+static int cmdStats(CmdLink *link, const int *arg, int *res, RTDB *database){
+	res[0] = arg[0];
+	for(int i = 1; i < 4; i++){
+		res[i] = arg[0] + i - 1 < CMD_STAT_N ? link->stat[arg[0] + i - 1] % CMD_STAT_MOD : 0;
+	}
+
+	return SUCCESS;
+}
+
+// # T [CS] ! - Read the jitter of the RTDB refresh, the maximum starts over
+static int cmdJitter(CmdLink *link, const int *arg, int *res, RTDB *database){
+	rtdbWriteBegin(database);
+
+	res[0] = database->jitLast;
+	res[1] = database->jitMax;
+	database->jitMax = 0;
+
+	rtdbWriteEnd(database);
+
+	for(int i = 0; i < 2; i++){
+		res[i] = res[i] > 999999 ? 999999 : res[i];	// Saturate to the field width
+	}
+	return SUCCESS;
+}
+
+// Link mode
+static int modeValidate(const int *arg){
+	return arg[0] != CMD_MODE_ASCII && arg[0] != CMD_MODE_BIN ? INVALID_ARG : SUCCESS;
+}
+
+// # M [0/1] [CS] ! - Switch the link to ASCII only or binary mode
+static int cmdMode(CmdLink *link, const int *arg, int *res, RTDB *database){
+	link->mode = arg[0];
+	res[0] = arg[0];
+
+	return SUCCESS;
+}
+
+// Sampling frequency (1 to AN_FREQ_MAX Hz)
+static int samplingValidate(const int *arg){
+	return arg[0] < 1 || arg[0] > AN_FREQ_MAX ? INVALID_FREQ : SUCCESS;
+}
+
+// # S [0000] [CS] ! - Change frequecy of sampling of analog input signal
+static int cmdSampling(CmdLink *link, const int *arg, int *res, RTDB *database){
+	rtdbWriteBegin(database);
+
+	database->anFreq = arg[0];
+
+	rtdbWriteEnd(database);
+
+	res[0] = arg[0];
+	return SUCCESS;
+}
+
+// # P [CS] ! - Toggle Analog reading mode
+static int cmdAnMode(CmdLink *link, const int *arg, int *res, RTDB *database){
+	rtdbWriteBegin(database);
+
+	database->anMode = database->anMode == AN_MODE_CONT ? AN_MODE_SINGLE : AN_MODE_CONT;
+	res[0] = database->anMode;
+
+	rtdbWriteEnd(database);
+
+	return SUCCESS;
+}
+
+// Frame check
+static int checkValidate(const int *arg){
+	return arg[0] != CMD_CHECK_SUM && arg[0] != CMD_CHECK_CRC16 && arg[0] != CMD_CHECK_CRC32 ? INVALID_ARG : SUCCESS;
+}
+
+// # K [0/1/2] [CS] ! - Select the integrity check of the next frames
+static int cmdCheck(CmdLink *link, const int *arg, int *res, RTDB *database){
+	link->check = arg[0];
+	res[0] = arg[0];
+
+	return SUCCESS;
+}
+
+// Subscription signal and state
+static int subValidate(const int *arg){
+	return arg[0] >= CMD_SUB_N || arg[1] > 1 ? INVALID_ARG : SUCCESS;
+}
+
+// # W [0/1] [0/1] [dddd] [iiii] [CS] ! - Subscribe to the changes of a signal, pushed by cmdPush()
+static int cmdSubscribe(CmdLink *link, const int *arg, int *res, RTDB *database){
+	CmdSub *sub = &link->sub[arg[0]];
+
+	k_mutex_lock(&test_mutex, K_FOREVER);	// cmdPush() runs on thread0
+
+	sub->on = arg[1];
+	sub->deadband = arg[0] == CMD_SUB_AN ? arg[2] : 0;	// Every change of the buttons is pushed
+	sub->interval = arg[3];
+	sub->primed = 0;
+
+	k_mutex_unlock(&test_mutex);
+
+	res[0] = arg[0];
+	res[1] = arg[1];
+	return SUCCESS;
+}
+
+// Number of samples (1 to CMD_HIST_MAX) and offset, every page lies in the readable part of the history
+static int histValidate(const int *arg){
+	return arg[0] < 1 || arg[0] > CMD_HIST_MAX || arg[1] < 0 || arg[0] + arg[1] >= HIST_SIZE ? INVALID_ARG : SUCCESS;
+}
+
+// # Y [nn] [oo] [CS] ! - Read nn analog samples ending oo samples before the newest, resp: # y [nn] [first time] {[dt] [value]}... [CS] !
+static int cmdHistory(CmdLink *link, const int *arg, int *res, RTDB *database){
+	RtdbSample s[CMD_HIST_MAX];
+	int n = rtdbHistRead(database, s, arg[0], arg[1]);	// Fewer samples right after boot
+
+	res[0] = n;
+	res[1] = n > 0 ? s[0].time % CMD_STAT_MOD : 0;	// 9 digits like the counters
+	for(int i = 0; i < n; i++){
+		uint32_t dt = i > 0 ? s[i].time - s[i-1].time : 0;
+
+		res[2+2*i] = dt > 99999 ? 99999 : dt;	// Saturate to the field width
+		res[3+2*i] = s[i].value;
+	}
+
+	return SUCCESS;
+}
+
+// Kind and io bit of every RTDB signal indexed by its ID
+#define SIG_ENTRY(name, kind, bit, alias) {kind, bit},
+static const struct{
+	unsigned char kind;
+	unsigned char bit;
+} sigTable[SIG_N] = {
+	RTDB_SIGNALS(SIG_ENTRY)
+};
+
+// Signal ID and read (0) or write (1)
+static int sigValidate(const int *arg){
+	return arg[0] >= SIG_N || arg[1] > 1 ? INVALID_ARG : SUCCESS;
+}
+
+// # I [ii] [0/1] [vvvv] [CS] ! - Read or write any RTDB signal, resp: # i [ii] [vvvv] [CS] !
+static int cmdSignal(CmdLink *link, const int *arg, int *res, RTDB *database){
+	long bit = 1L << sigTable[arg[0]].bit;
+
+	if(arg[1] == 1){ // Only the digital outputs can be written, with 0 or 1
+		if(sigTable[arg[0]].kind != SIG_DOUT || arg[2] > 1){
+			return INVALID_ARG;
+		}
+		if(arg[2]){
+			atomic_or(&database->io, bit);
+		} else{
+			atomic_and(&database->io, ~bit);
+		}
+	}
+
+	res[0] = arg[0];
+	if(sigTable[arg[0]].kind == SIG_AN){
+		res[1] = __atomic_load_n(&database->anRaw, __ATOMIC_RELAXED);
+	} else{
+		res[1] = (atomic_get(&database->io) & bit) != 0;
+	}
+	return SUCCESS;
+}
+
+// # D [vvvvvvvvv] [CS] ! - Read the groups changed after generation vvvvvvvvv, resp: # d [n] [generation] {[group] [value]}... [CS] !
+static int cmdDelta(CmdLink *link, const int *arg, int *res, RTDB *database){
+	uint32_t gen = __atomic_load_n(&database->gen, __ATOMIC_ACQUIRE);	// Before the versions and the values
+	int n = 0;
+
+	for(int g = 0; g < RTDB_GRP_N; g++){
+		uint32_t ver = __atomic_load_n(&database->ver[g], __ATOMIC_ACQUIRE);
+
+		if(ver <= (uint32_t)arg[0] && (uint32_t)arg[0] <= gen){ // A client ahead of gen is from before the wrap, it gets everything
+			continue;
+		}
+		res[2+2*n] = g;
+		switch(g){
+			case RTDB_GRP_BUT:
+				res[3+2*n] = (atomic_get(&database->io) & RTDB_BUT_MASK) >> RTDB_BUT_SHIFT;
+				break;
+			case RTDB_GRP_LED:
+				res[3+2*n] = atomic_get(&database->io) & RTDB_LED_MASK;
+				break;
+			default:
+				res[3+2*n] = __atomic_load_n(&database->anRaw, __ATOMIC_RELAXED);
+				break;
+		}
+		n++;
+	}
+
+	res[0] = n;
+	res[1] = gen;
+	return SUCCESS;
+}
+
+static const CmdDesc cmdB = {'B', 0, {}, 1, {CMD_BITS(4)}, 0, NULL, cmdButtons};
+static const CmdDesc cmdL = {'L', 1, {CMD_DEC(1)}, 2, {CMD_DEC(1), CMD_DEC(1)}, UNKNOWN_LED, ledValidate, cmdLed};
+static const CmdDesc cmdA = {'A', 0, {}, 1, {CMD_DEC(4)}, 0, NULL, cmdAnalog};
+static const CmdDesc cmdU = {'U', 1, {CMD_DEC(2)}, 1, {CMD_DEC(2)}, INVALID_FREQ, periodValidate, cmdPeriod};
+static const CmdDesc cmdS = {'S', 1, {CMD_DEC(4)}, 1, {CMD_DEC(4)}, INVALID_FREQ, samplingValidate, cmdSampling};
+static const CmdDesc cmdP = {'P', 0, {}, 1, {CMD_DEC(1)}, 0, NULL, cmdAnMode};
+static const CmdDesc cmdM = {'M', 1, {CMD_DEC(1)}, 1, {CMD_DEC(1)}, INVALID_ARG, modeValidate, cmdMode};
+static const CmdDesc cmdK = {'K', 1, {CMD_DEC(1)}, 1, {CMD_DEC(1)}, INVALID_ARG, checkValidate, cmdCheck};
+static const CmdDesc cmdR = {'R', 1, {CMD_DEC(7)}, 1, {CMD_DEC(7)}, INVALID_ARG, baudValidate, cmdBaud};
+static const CmdDesc cmdQ = {'Q', 1, {CMD_DEC(2)}, 4, {CMD_DEC(2), CMD_DEC(9), CMD_DEC(9), CMD_DEC(9)}, INVALID_ARG, statValidate, cmdStats};
+static const CmdDesc cmdT = {'T', 0, {}, 2, {CMD_DEC(6), CMD_DEC(6)}, 0, NULL, cmdJitter};
+static const CmdDesc cmdW = {'W', 4, {CMD_DEC(1), CMD_DEC(1), CMD_DEC(4), CMD_DEC(4)}, 2, {CMD_DEC(1), CMD_DEC(1)}, INVALID_ARG, subValidate, cmdSubscribe};
+static const CmdDesc cmdY = {'Y', 2, {CMD_DEC(2), CMD_DEC(2)}, 4, {CMD_DEC(2), CMD_DEC(9), CMD_DEC(5), CMD_DEC(4)}, INVALID_ARG, histValidate, cmdHistory, 2, CMD_HIST_MAX};
+static const CmdDesc cmdI = {'I', 3, {CMD_DEC(2), CMD_DEC(1), CMD_DEC(4)}, 2, {CMD_DEC(2), CMD_DEC(4)}, INVALID_ARG, sigValidate, cmdSignal};
+static const CmdDesc cmdD = {'D', 1, {CMD_DEC(9)}, 4, {CMD_DEC(1), CMD_DEC(9), CMD_DEC(1), CMD_DEC(4)}, INVALID_ARG, NULL, cmdDelta, 2, RTDB_GRP_N};
+static const CmdDesc cmdX = {'X'};	// Batch, DATA is a list of sub-commands handled by batchRun()
+
+// Registered commands indexed by CMD, new ones are added with cmdRegister()
+static const CmdDesc *cmdTable[128] = {
+	['B'] = &cmdB,
+	['L'] = &cmdL,
+	['A'] = &cmdA,
+	['U'] = &cmdU,
+	['S'] = &cmdS,
+	['P'] = &cmdP,
+	['M'] = &cmdM,
+	['K'] = &cmdK,
+	['W'] = &cmdW,
+	['R'] = &cmdR,
+	['Q'] = &cmdQ,
+	['T'] = &cmdT,
+	['Y'] = &cmdY,
+	['I'] = &cmdI,
+	['D'] = &cmdD,
+	['X'] = &cmdX,
+};
+
+// Number of bytes a field takes in a binary payload
+static int binFieldSize(const CmdField *f){
+	if(f->kind == FIELD_BITS){
+		return (f->width + 7) / 8;
+	}
+	return f->width <= 2 ? 1 : f->width <= 4 ? 2 : 4;
+}
+
+// Number of ASCII characters or binary bytes taken by a list of fields
+static int fieldsSize(const CmdField *f, int n, int binary){
+	int size = 0;
+
+	for(int i = 0; i < n; i++){
+		size += binary ? binFieldSize(&f[i]) : f[i].width;
+	}
+
+	return size;
+}
+
+// Output frame being built, the ASCII checksum is accumulated while the bytes are written
+typedef struct{
+	uint8_t *buf;		// Start of the frame
+	uint8_t *p;			// Next free position in the output buffer
+	unsigned char cs;	// Running modulo 256 checksum of CMD and DATA
+	int binary;			// 1 for a binary frame
+	int check;			// CMD_CHECK_SUM, CMD_CHECK_CRC16 or CMD_CHECK_CRC32
+	int tag;			// Tag of the request echoed by fwPutOp(), CMD_NO_TAG if it had none
+	uint8_t *end;		// End of the UART_TX_SIZE output buffer
+} FrameWriter;
+
+static void fwBegin(FrameWriter *w, uint8_t *buf, int binary, int check, int tag){
+	w->buf = buf;
+	w->cs = 0;
+	w->binary = binary;
+	w->check = check;
+	w->tag = tag;
+	w->end = buf + UART_TX_SIZE;
+	buf[0] = binary ? BIN_SYNC : SOF_SYM;
+	w->p = binary ? &buf[2] : &buf[1]; // Binary LEN is written by fwEnd()
+}
+
+static void fwPut(FrameWriter *w, uint8_t c){
+	*w->p++ = c;
+	w->cs += c;
+}
+
+static const char hexDigits[16] = "0123456789ABCDEF";
+
+// Writes the lower case opcode of the response and the tag of the request
+static void fwPutOp(FrameWriter *w, unsigned char op){
+	if(w->tag == CMD_NO_TAG){
+		fwPut(w, op | 0x20);
+	} else if(w->binary){ // OP with CMD_TAG_FLAG set, then TAG
+		fwPut(w, op | 0x20 | CMD_TAG_FLAG);
+		fwPut(w, w->tag);
+	} else{ // TAG_SYM and two hexadecimal digits, then OP
+		fwPut(w, TAG_SYM);
+		fwPut(w, hexDigits[w->tag >> 4]);
+		fwPut(w, hexDigits[w->tag & 0xF]);
+		fwPut(w, op | 0x20);
+	}
+}
+
+// Writes v in decimal zero padded to width digits, same output as "%0*d"
+static void fwPutDec(FrameWriter *w, int v, int width){
+	char tmp[10];
+	unsigned int u = v < 0 ? -(unsigned int)v : (unsigned int)v;
+	int n = 0;
+
+	if(v < 0){
+		fwPut(w, '-');
+		width--;
+	}
+	do{
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while(u);
+	while(width-- > n){
+		fwPut(w, '0');
+	}
+	while(n){
+		fwPut(w, tmp[--n]);
+	}
+}
+
+// Writes a result field, ASCII characters or big endian binary bytes
+static void fwPutField(FrameWriter *w, const CmdField *f, int v){
+	if(w->binary){
+		for(int j = binFieldSize(f) - 1; j >= 0; j--){
+			fwPut(w, (uint8_t)(v >> (8*j)));
+		}
+	} else if(f->kind == FIELD_BITS){
+		for(int j = 0; j < f->width; j++){
+			fwPut(w, '0' + ((v >> j) & 1));
+		}
+	} else{
+		fwPutDec(w, v, f->width);
+	}
+}
+
+// Number of ASCII characters of the CS field
+static int csLen(int check){
+	return check == CMD_CHECK_CRC32 ? 8 : check == CMD_CHECK_CRC16 ? 4 : 3;
+}
+
+// Number of CRC bytes of a binary frame, binary frames always use a CRC
+static int crcLen(int check){
+	return check == CMD_CHECK_CRC32 ? 4 : 2;
+}
+
+// Bytes left for CMD and DATA once the CS, EOF and NULL (ASCII) or the CRC (binary) are accounted for
+static int fwRoom(const FrameWriter *w){
+	return w->end - w->p - (w->binary ? crcLen(w->check) : csLen(w->check) + 2);
+}
+
+// Largest number of ASCII characters or binary bytes of the results of a command
+static int resMaxSize(const CmdDesc *desc, int binary){
+	int fixed = desc->nRes - desc->nRep;
+
+	return fieldsSize(desc->res, fixed, binary) + desc->maxRep * fieldsSize(&desc->res[fixed], desc->nRep, binary);
+}
+
+// Bytes a frame takes around CMD/DATA fields in the worst case: SOF, TAG_SYM and 2 tag digits, OP, 8 CS digits, EOF and
+// NULL (ASCII) or SYNC, LEN, OP, tag and the CRC-32 (binary)
+static int frameOverhead(int binary){
+	return binary ? 4 + 4 : 1 + 3 + 1 + 8 + 1 + 1;
+}
+
+// Fields an int holds: up to CMD_DEC_MAX digits or CMD_BITS_MAX bits
+static int fieldsOk(const CmdField *f, int n){
+	for(int i = 0; i < n; i++){
+		if(f[i].width < 1 || f[i].width > (f[i].kind == FIELD_BITS ? CMD_BITS_MAX : CMD_DEC_MAX)){
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Integrity value of the n bytes of buf
+static uint32_t calcCheck(const uint8_t *buf, int n, int check){
+	switch(check){
+		case CMD_CHECK_CRC16:
+			return calcCrc16(buf, n);
+		case CMD_CHECK_CRC32:
+			return calcCrc32(buf, n);
+		default:
+			return calcChecksum((unsigned char *)buf, n);
+	}
+}
+
+// Appends the CS field and the EOF (ASCII) or LEN and CRC (binary), returns the frame length
+static int fwEnd(FrameWriter *w){
+	uint32_t crc;
+
+	if(w->binary){
+		w->buf[1] = w->p - &w->buf[2];
+		crc = calcCheck(&w->buf[1], w->buf[1] + 1, w->check == CMD_CHECK_CRC32 ? CMD_CHECK_CRC32 : CMD_CHECK_CRC16);
+		for(int i = crcLen(w->check) - 1; i >= 0; i--){
+			*w->p++ = (uint8_t)(crc >> (8*i));
+		}
+		return w->p - w->buf;
+	}
+	if(w->check == CMD_CHECK_SUM){ // Modulo 256 sum already accumulated, 3 decimal digits
+		*w->p++ = '0' + w->cs / 100;
+		*w->p++ = '0' + (w->cs / 10) % 10;
+		*w->p++ = '0' + w->cs % 10;
+	} else{ // CRC of CMD and DATA in upper case hexadecimal
+		crc = calcCheck(&w->buf[1], w->p - &w->buf[1], w->check);
+		for(int i = csLen(w->check) - 1; i >= 0; i--){
+			*w->p++ = hexDigits[(crc >> (4*i)) & 0xF];
+		}
+	}
+	*w->p++ = EOF_SYM;
+	*w->p = '\0';
+
+	return w->p - w->buf;
+}
+
+// Value of a hexadecimal digit in either case, -1 if c is not one
+static int hexValue(char c){
+	unsigned int d = c - '0';
+
+	if(d > 9){
+		d = (c | 0x20) - 'a' + 10;
+		if(d < 10 || d > 15){
+			return -1;
+		}
+	}
+
+	return d;
+}
+
+// Checks the CS field that follows the n CMD/DATA bytes of the frame
+static int checkOk(const char *cmd, int n, int check){
+	const char *cs = &cmd[n+1];
+	uint32_t val = 0;
+
+	for(int i = 0; i < csLen(check); i++){
+		unsigned int d = cs[i] - '0';
+
+		if(check == CMD_CHECK_SUM){
+			if(d > 9){
+				return 0;
 			}
+			val = val*10 + d;
+			continue;
+		}
+		if(hexValue(cs[i]) < 0){
+			return 0;
+		}
+		val = val << 4 | hexValue(cs[i]);
+	}
+
+	return val == calcCheck((const uint8_t *)&cmd[1], n, check);
+}
 
-			// Read AnVal
-			k_mutex_lock(&test_mutex, K_FOREVER);
-			
-			var = (int)database->anRaw;
+// Returns the descriptor of an opcode, NULL if it is unknown
+static const CmdDesc *cmdLookup(unsigned char op){
+	return op < sizeof(cmdTable)/sizeof(cmdTable[0]) ? cmdTable[op] : NULL;
+}
 
-			k_mutex_unlock(&test_mutex);
+// Decodes the arguments, ASCII characters or big endian binary bytes, and checks their range
+static int getArgs(const CmdDesc *desc, const uint8_t *data, int binary, int *arg){
+	for(int i = 0; i < desc->nArg; i++){
+		int size = binary ? binFieldSize(&desc->arg[i]) : desc->arg[i].width;
 
-			// Response Command
-			sprintf(resp, "a%04d", var);
-			sprintf(checksum, "%03d", calcChecksum((unsigned char*)&(resp[0]), 5));
-			sprintf(resp, "#a%04d%s!", var, checksum);
+		arg[i] = 0;
+		for(int j = 0; j < size; j++){
+			unsigned int d = *data++;
 
-			return SUCCESS;	// case 'A'
-		case 'U': // # U [00] [CS] ! - Change frequecy of update of the in/out digital signals of RTDB
-			// Validate frame structure
-			if(cmd[7] != EOF_SYM){
-				return MISSING_EOF;
+			if(binary){
+				arg[i] = (arg[i] << 8) | d;
+				continue;
 			}
-			
-			// Validate Frequecy value
-			if(!isdigit(cmd[2]) || !isdigit(cmd[2])){
-				return INVALID_FREQ;
+			d -= '0';
+			if(d > (desc->arg[i].kind == FIELD_BITS ? 1u : 9u)){
+				return desc->argErr;
 			}
+			arg[i] = desc->arg[i].kind == FIELD_BITS ? arg[i] | d << j : arg[i]*10 + d;
+		}
+	}
 
-			// Validate checksum
-			expectedChecksum = calcChecksum(&(cmd[1]), 3);
-			sprintf(receivedChecksum, "%c%c%c", cmd[4], cmd[5], cmd[6]);
-			if(atoi(receivedChecksum) != expectedChecksum){
-				return WRONG_CS;
-			}
+	return desc->validate == NULL ? SUCCESS : desc->validate(arg);
+}
 
-			// Response Command
-			var = ((cmd[2] - '0')*10 + (cmd[3] - '0'))*pow(10, 6); // New frequecy of update
-			updateFreq(var);
-			sprintf(resp, "u%c%c", cmd[2], cmd[3]);
-			sprintf(checksum, "%03d", calcChecksum((unsigned char*)&(resp[0]), 3));
-			sprintf(resp, "#u%c%c%s!", cmd[2], cmd[3], checksum);
+// Writes the results of a command, the trailing nRep fields are repeated res[0] times
+static void putFields(FrameWriter *w, const CmdDesc *desc, const int *res){
+	int fixed = desc->nRes - desc->nRep;
+	int n = desc->nRep ? fixed + desc->nRep * res[0] : desc->nRes;
 
-			return SUCCESS;	// case 'U'
-		default:
-			return UNKNOWN_CMD;				
+	for(int i = 0; i < n; i++){
+		fwPutField(w, &desc->res[i < fixed ? i : fixed + (i - fixed) % desc->nRep], res[i]);
+	}
+}
+
+// Writes the lower case opcode and the results of a command
+static void putResults(FrameWriter *w, unsigned char op, const CmdDesc *desc, const int *res){
+	fwPutOp(w, op);
+	putFields(w, desc, res);
+}
+
+static const CmdField status = CMD_DEC(1);	// 0 or the error code without the -100 offset
+
+// Number of sub-commands of a batch, counting stops at the first unknown opcode
+static int batchCount(const uint8_t *data, int len, int binary){
+	const CmdDesc *desc;
+	int n = 0;
+
+	while(len > 0){
+		n++;
+		desc = cmdLookup(*data);
+		if(desc == NULL || *data == 'X'){
+			break;
+		}
+		len -= 1 + fieldsSize(desc->arg, desc->nArg, binary);
+		data += 1 + fieldsSize(desc->arg, desc->nArg, binary);
+	}
+
+	return n;
+}
+
+// Runs the sub-commands of a batch in order, the response is 'x' followed by CMD STATUS [DATA] for each one
+static int batchRun(CmdLink *link, const uint8_t *data, int len, int binary, int check, int tag, uint8_t *resp, RTDB *database){
+	const CmdDesc *desc;
+	int arg[CMD_MAX_FIELDS], res[CMD_MAX_RES];
+	FrameWriter w;
+	int size = 0;
+	int err = 0;
+
+	if(len == 0 || batchCount(data, len, binary) > CMD_MAX_BATCH){
+		return INVALID_LEN;
+	}
+
+	fwBegin(&w, resp, binary, check, tag);
+	fwPutOp(&w, 'X');
+	while(len > 0){
+		unsigned char op = *data++;
+
+		len--;
+		fwPut(&w, op | 0x20);
+		desc = cmdLookup(op);
+		if(desc != NULL && op != 'X' && fwRoom(&w) < 1 + resMaxSize(desc, binary) + 2){ // STATUS and results, then a last CMD STATUS
+			fwPutField(&w, &status, -(INVALID_LEN) - 100);
+			break;
+		}
+		if(desc == NULL || op == 'X'){ // Length unknown, nothing after it can be decoded
+			fwPutField(&w, &status, -(UNKNOWN_CMD) - 100);
+			break;
+		}
+		size = fieldsSize(desc->arg, desc->nArg, binary);
+		if(size > len){
+			fwPutField(&w, &status, -(INVALID_LEN) - 100);
+			break;
+		}
+		err = getArgs(desc, data, binary, arg);
+		if(err == SUCCESS){
+			err = desc->handler(link, arg, res, database);
+		}
+		data += size;
+		len -= size;
+		if(err != SUCCESS){
+			fwPutField(&w, &status, -err - 100);
+			continue;
+		}
+		fwPutField(&w, &status, 0);
+		putFields(&w, desc, res);
+	}
+
+	return fwEnd(&w);
+}
+
+// Answers a failed tagged request with ERR_SYM and the error code without the -100 offset
+static int errorFrame(uint8_t *resp, int binary, int check, int tag, int err){
+	FrameWriter w;
+
+	fwBegin(&w, resp, binary, check, tag);
+	fwPutOp(&w, ERR_SYM);
+	fwPutField(&w, &status, -err - 100);
+
+	return fwEnd(&w);
+}
+
+// Handles a "# [@ TT] CMD DATA CS !" frame, the tag is given back as soon as it is decoded
+static int asciiProcess(CmdLink *link, const char *cmd, uint8_t *resp, RTDB *database, int *tagOut){
+	unsigned char op;
+	int check = link->check;	// The response uses the check of the request even if 'K' changes it
+	int tag = CMD_NO_TAG;
+	int hdr = 1;				// SOF and the optional tag
+	const CmdDesc *desc;
+	int arg[CMD_MAX_FIELDS], res[CMD_MAX_RES];
+	FrameWriter w;
+	int dataLen = 0;
+	int err = 0;
+
+	if(cmd[0] != SOF_SYM){
+		return MISSING_SOF;
+	}
+	if(cmd[1] == TAG_SYM){
+		if(hexValue(cmd[2]) < 0 || hexValue(cmd[3]) < 0){
+			return INVALID_ARG;
+		}
+		tag = hexValue(cmd[2]) << 4 | hexValue(cmd[3]);
+		if(tag == CMD_PUSH_TAG){ // Its error frame would look like a push
+			return INVALID_ARG;
+		}
+		*tagOut = tag;
+		hdr = 4;
+	}
+	op = (unsigned char)cmd[hdr];
+	desc = cmdLookup(op);
+	if(desc == NULL){
+		return UNKNOWN_CMD;
+	}
+
+	// Batch, # X [CMD DATA]... [CS] !
+	if(op == 'X'){
+		dataLen = strlen(cmd) - hdr - 2 - csLen(check);
+		if(dataLen < 0 || cmd[hdr+dataLen+1+csLen(check)] != EOF_SYM){
+			return MISSING_EOF;
+		}
+		if(!checkOk(cmd, hdr+dataLen, check)){
+			return WRONG_CS;
+		}
+		return batchRun(link, (const uint8_t *)&cmd[hdr+1], dataLen, 0, check, tag, resp, database);
+	}
+
+	// Validate frame structure
+	dataLen = fieldsSize(desc->arg, desc->nArg, 0);
+	if(cmd[hdr+dataLen+1+csLen(check)] != EOF_SYM){
+		return MISSING_EOF;
+	}
+
+	// Validate DATA
+	err = getArgs(desc, (const uint8_t *)&cmd[hdr+1], 0, arg);
+	if(err != SUCCESS){
+		return err;
+	}
+
+	// Validate checksum, the tag is covered too
+	if(!checkOk(cmd, hdr+dataLen, check)){
+		return WRONG_CS;
+	}
+
+	err = desc->handler(link, arg, res, database);
+	if(err != SUCCESS){
+		return err;
+	}
+
+	fwBegin(&w, resp, 0, check, tag);
+	putResults(&w, op, desc, res);
+	return fwEnd(&w);
+}
+
+// Handles a "SYNC LEN OP [TAG] PAYLOAD CRC" frame, the tag is given back as soon as it is decoded
+static int binProcess(CmdLink *link, const uint8_t *frame, int len, uint8_t *resp, RTDB *database, int *tagOut){
+	int check = link->check == CMD_CHECK_CRC32 ? CMD_CHECK_CRC32 : CMD_CHECK_CRC16;
+	uint32_t crc = 0;
+	unsigned char op;
+	int tag = CMD_NO_TAG;
+	const uint8_t *payload = &frame[3];
+	int payloadLen = frame[1] - 1;
+	const CmdDesc *desc;
+	int arg[CMD_MAX_FIELDS], res[CMD_MAX_RES];
+	FrameWriter w;
+	int err = 0;
+
+	// Validate frame structure and CRC
+	if(len < 3 || frame[1] == 0 || frame[1] > BIN_MAX_LEN || len != frame[1] + 2 + crcLen(check)){
+		return INVALID_LEN;
+	}
+	for(int i = frame[1] + 2; i < len; i++){
+		crc = crc << 8 | frame[i];
+	}
+	if(calcCheck(&frame[1], frame[1] + 1, check) != crc){
+		return WRONG_CS;
+	}
+
+	op = frame[2] & ~CMD_TAG_FLAG;
+	if(frame[2] & CMD_TAG_FLAG){
+		if(payloadLen == 0){
+			return INVALID_LEN;
+		}
+		tag = *payload++;
+		if(tag == CMD_PUSH_TAG){
+			return INVALID_ARG;
+		}
+		*tagOut = tag;
+		payloadLen--;
+	}
+	desc = cmdLookup(op);
+	if(desc == NULL){
+		return UNKNOWN_CMD;
+	}
+	if(op == 'X'){
+		return batchRun(link, payload, payloadLen, 1, check, tag, resp, database);
+	}
+	if(payloadLen != fieldsSize(desc->arg, desc->nArg, 1)){
+		return INVALID_LEN;
+	}
+
+	err = getArgs(desc, payload, 1, arg);
+	if(err == SUCCESS){
+		err = desc->handler(link, arg, res, database);
+	}
+	if(err != SUCCESS){
+		return err;
 	}
-	return MISSING_SOF;
+
+	fwBegin(&w, resp, 1, check, tag);
+	putResults(&w, op, desc, res);
+	return fwEnd(&w);
+}
+
+int cmdProcessor(char *cmd, char *resp, RTDB *database){
+	int tag = CMD_NO_TAG;
+	int ret = asciiProcess(&legacyLink, cmd, (uint8_t *)resp, database, &tag);
+
+	return ret > 0 ? SUCCESS : ret;
+}
+
+int cmdRegister(const CmdDesc *desc){
+	if(desc->op < 'A' || desc->op > 'Z' || desc->handler == NULL || cmdTable[desc->op] != NULL){
+		return INVALID_ARG;
+	}
+	if(desc->nArg > CMD_MAX_FIELDS || desc->nRes > CMD_MAX_FIELDS || (desc->nRep > 0 && (desc->nRep >= desc->nRes || desc->maxRep == 0 || desc->nRes + desc->nRep * (desc->maxRep - 1) > CMD_MAX_RES))){
+		return INVALID_ARG;
+	}
+	if(!fieldsOk(desc->arg, desc->nArg) || !fieldsOk(desc->res, desc->nRes)){
+		return INVALID_ARG;
+	}
+	// The request must fit an RX frame (FRAME_MAX_LEN) and the largest response the TX slot, handlers write with no room check
+	if(fieldsSize(desc->arg, desc->nArg, 0) + frameOverhead(0) > UART_RX_SIZE || 2 + fieldsSize(desc->arg, desc->nArg, 1) > BIN_MAX_LEN){
+		return INVALID_LEN;
+	}
+	if(resMaxSize(desc, 0) + frameOverhead(0) > UART_TX_SIZE || resMaxSize(desc, 1) + frameOverhead(1) > UART_TX_SIZE){
+		return INVALID_LEN;
+	}
+	cmdTable[desc->op] = desc;
+
+	return SUCCESS;
+}
+
+void cmdLinkInit(CmdLink *link){
+	link->mode = CMD_MODE_ASCII;
+	link->check = CMD_CHECK_DEFAULT;
+	memset(link->sub, 0, sizeof(link->sub));
+	memset(link->stat, 0, sizeof(link->stat));
+	link->baud = 0;
+}
+
+int cmdPush(CmdLink *link, RTDB *database, uint32_t now, uint8_t *resp){
+	static const CmdDesc *const subDesc[CMD_SUB_N] = {&cmdB, &cmdA};	// Read command of each signal
+	int binary = link->mode == CMD_MODE_BIN;
+	int res[CMD_MAX_RES];
+	FrameWriter w;
+	int len = 0;
+
+	k_mutex_lock(&test_mutex, K_FOREVER);	// Protects the subscriptions, changed by 'W' on the command thread
+
+	for(int i = 0; i < CMD_SUB_N && len == 0; i++){
+		CmdSub *sub = &link->sub[i];
+		int delta;
+
+		if(!sub->on || (sub->primed && now - sub->time < sub->interval)){
+			continue;
+		}
+		subDesc[i]->handler(link, NULL, res, database);
+		delta = res[0] > sub->value ? res[0] - sub->value : sub->value - res[0];
+		if(sub->primed && delta <= sub->deadband){
+			continue;
+		}
+		if(resp == NULL){ // Only asked whether there is something to push
+			len = 1;
+			break;
+		}
+		sub->value = res[0];
+		sub->primed = 1;
+		sub->time = now;
+		fwBegin(&w, resp, binary, binary && link->check != CMD_CHECK_CRC32 ? CMD_CHECK_CRC16 : link->check, CMD_PUSH_TAG);
+		putResults(&w, subDesc[i]->op, subDesc[i], res);
+		len = fwEnd(&w);
+	}
+
+	k_mutex_unlock(&test_mutex);
+
+	return len;
+}
+
+int cmdProcess(CmdLink *link, const uint8_t *frame, int len, uint8_t *resp, RTDB *database){
+	int binary = len > 0 && frame[0] == BIN_SYNC;
+	int tag = CMD_NO_TAG;
+	int ret;
+
+	if(binary){
+		ret = binProcess(link, frame, len, resp, database, &tag);
+	} else{
+		ret = asciiProcess(link, (const char *)frame, resp, database, &tag);
+	}
+	if(ret < 0){
+		link->stat[CMD_STAT_ERR - ret - 100]++;
+		if(tag != CMD_NO_TAG){ // The host matches the failure by its tag instead of waiting for a timeout
+			ret = errorFrame(resp, binary, binary && link->check != CMD_CHECK_CRC32 ? CMD_CHECK_CRC16 : link->check, tag, ret);
+		}
+	}
+
+	return ret;
 }
 
 unsigned char calcChecksum(unsigned char *buf, int nbytes){
@@ -151,4 +899,4 @@ unsigned char calcChecksum(unsigned char *buf, int nbytes){
 	}
 
 	return checksum;
-}
\ No newline at end of file
+}
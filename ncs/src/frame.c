@@ -0,0 +1,151 @@
+/** @file frame.c
+ * @brief Implementation of the streaming frame decoder and of the frame queue
+ *
+ * @author Gonçalo Peralta & João Alvares
+ * @date 17 October 2026
+ * @bug No known bugs.
+*/
+#include <string.h>
+
+#include "../includes/frame.h"
+
+// Queues a complete frame and counts it
+static int frameDone(FrameDecoder *dec, FrameQueue *q){
+	int ok = frameQueuePush(q, dec->buf, dec->len);
+
+	dec->link->stat[ok ? CMD_STAT_FRAMES : CMD_STAT_RX_DROP]++;
+
+	return ok;
+}
+
+// Waits for the next frame
+static void frameReset(FrameDecoder *dec){
+	dec->state = FRAME_IDLE;
+	dec->len = 0;
+	dec->need = 0;
+}
+
+void frameDecoderInit(FrameDecoder *dec, CmdLink *link){
+	frameReset(dec);
+	dec->link = link;
+}
+
+void frameQueueInit(FrameQueue *q){
+	q->head = 0;
+	q->tail = 0;
+	q->dropped = 0;
+}
+
+char *frameQueueReserve(FrameQueue *q){
+	unsigned int head = q->head;
+
+	if(head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == FRAME_QUEUE_LEN){
+		q->dropped++;
+		return NULL;
+	}
+
+	return q->frame[head % FRAME_QUEUE_LEN].buf;
+}
+
+// The slot is published only after it is written
+void frameQueueCommit(FrameQueue *q, int len){
+	q->frame[q->head % FRAME_QUEUE_LEN].len = len;
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+int frameQueuePush(FrameQueue *q, const char *frame, int len){
+	char *buf = frameQueueReserve(q);
+
+	if(buf == NULL){
+		return 0;
+	}
+	memcpy(buf, frame, len);
+	buf[len] = '\0';
+	frameQueueCommit(q, len);
+
+	return 1;
+}
+
+int frameFeed(FrameDecoder *dec, FrameQueue *q, const uint8_t *data, int len){
+	int frames = 0;
+
+	dec->link->stat[CMD_STAT_RX_BYTES] += len;
+	for(int i = 0; i < len; i++){
+		uint8_t c = data[i];
+
+		switch(dec->state){
+			case FRAME_BIN_LEN: // LEN byte, bounded so the frame fits the buffer
+				if(c == 0 || c > BIN_MAX_LEN){
+					frameReset(dec);
+					break;
+				}
+				dec->buf[dec->len++] = c;
+				dec->need = c + (dec->link->check == CMD_CHECK_CRC32 ? 4 : 2); // OP, PAYLOAD and CRC
+				dec->state = FRAME_BIN_BODY;
+				break;
+			case FRAME_BIN_BODY: // Binary bytes are never interpreted as symbols
+				dec->buf[dec->len++] = c;
+				if(--dec->need == 0){
+					frames += frameDone(dec, q);
+					frameReset(dec);
+				}
+				break;
+			default:
+				if(c == SOF_SYM){ // Always (re)start the frame
+					dec->buf[0] = c;
+					dec->len = 1;
+					dec->state = FRAME_BODY;
+				} else if(c == BIN_SYNC && dec->link->mode == CMD_MODE_BIN){
+					dec->buf[0] = c;
+					dec->len = 1;
+					dec->state = FRAME_BIN_LEN;
+				} else if(dec->state == FRAME_IDLE){ // Garbage between frames
+					break;
+				} else if(dec->len == FRAME_MAX_LEN-1){ // Too long for a command, wait for the next SOF
+					frameReset(dec);
+				} else{
+					dec->buf[dec->len++] = c;
+					if(c == EOF_SYM){
+						frames += frameDone(dec, q);
+						frameReset(dec);
+					}
+				}
+				break;
+		}
+	}
+
+	return frames;
+}
+
+int frameQueuePop(FrameQueue *q, char *frame){
+	unsigned int tail = q->tail;
+	int len;
+
+	if(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail){
+		return 0;
+	}
+	len = q->frame[tail % FRAME_QUEUE_LEN].len;
+	memcpy(frame, q->frame[tail % FRAME_QUEUE_LEN].buf, len + 1);
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return len;
+}
+
+int frameQueueLevel(FrameQueue *q){
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+const char *frameQueuePeek(FrameQueue *q, int *len){
+	unsigned int tail = q->tail;
+
+	if(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail){
+		return NULL;
+	}
+	*len = q->frame[tail % FRAME_QUEUE_LEN].len;
+
+	return q->frame[tail % FRAME_QUEUE_LEN].buf;
+}
+
+void frameQueueRelease(FrameQueue *q){
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
@@ -17,19 +17,21 @@
 #include "../includes/funcs.h"
 
 void initRTDB(RTDB *rtdb){
-    rtdb->led[0] = 0;
-    rtdb->led[1] = 0;
-    rtdb->led[2] = 0;
-    rtdb->led[3] = 0;
-    rtdb->but[0] = 0;
-    rtdb->but[1] = 0;
-    rtdb->but[2] = 0;
-    rtdb->but[3] = 0;
+    rtdb->seq = 0;
+    atomic_set(&rtdb->io, 0);
     rtdb->anRaw = 0;
-    rtdb->anVal = 0;
+    rtdb->anMode = AN_MODE_SINGLE;
+    rtdb->anFreq = AN_FREQ_DEFAULT;
+    rtdb->jitLast = 0;
+    rtdb->jitMax = 0;
+    rtdb->gen = 1;     // A client starting from 0 gets every group
+    for(int i = 0; i < RTDB_GRP_N; i++){
+        rtdb->ver[i] = 1;
+    }
+    rtdb->hist.head = 0;
 }
 
 void consoleLog(int err){
-    char errorLog[6][50] = {"Missing Start of frame '#'", "Missing Eof of frame '!'", "Wrong Checksum", "Invalid type not identified", "Invalid LED number", "Invalid Frequency"};
+    char errorLog[8][50] = {"Missing Start of frame '#'", "Missing Eof of frame '!'", "Wrong Checksum", "Invalid type not identified", "Invalid LED number", "Invalid Frequency", "Invalid frame length", "Invalid argument"};
 	printk("[LOG] Error in command structure: %s\n", errorLog[abs(err)-100]);
 }
@@ -3,7 +3,7 @@
  * 
  * @author Gonçalo Peralta & João Alvares
  * @date 03 June 2024
- * @bug Line 204, uart_tx() function not working as expected, it only send some character from the tx_buf so it was replaced with printk()
+ * @bug No known bugs.
 */
 
 #include <zephyr/kernel.h>
@@ -14,17 +14,26 @@
 #include <zephyr/drivers/uart.h>
 #include <zephyr/devicetree.h>
 #include <zephyr/drivers/adc.h>
+#include <zephyr/usb/usb_device.h>
+#ifdef CONFIG_UART_ASYNC_ADAPTER
+#include <uart_async_adapter.h>
+#endif
 
 #include <string.h>
 #include <stdlib.h>
-#include <math.h>
 
 #include "../includes/cmdproc.h"
 #include "../includes/funcs.h"
+#include "../includes/frame.h"
+#include "../includes/store.h"
 
 // Config ADC
 #define SLEEP_TIME_MS 	1000
+#if DT_NODE_EXISTS(DT_ALIAS(ncs_adc))
+#define ADC_NODE		DT_ALIAS(ncs_adc)		// Board overlay, e.g. boards/native_sim.overlay
+#else
 #define ADC_NODE		DT_NODELABEL(adc)		// DT_N_S_soc_S_adc_40007000
+#endif
 #define ADC_RESOLUTION	10
 #define ADC_CHANNEL 	0
 #define ADC_PORT 		SAADC_CH_PSELP_PSELP_AnalogInput0	// AIN0
@@ -50,31 +59,102 @@ struct adc_sequence sequence = {
 	.resolution  = ADC_RESOLUTION
 };
 
+// Continuous sampling, the ADC driver timer takes AN_BUF_SIZE samples spaced by interval_us per adc_read()
+#define AN_BUF_SIZE 32
+static int16_t an_buf[AN_BUF_SIZE];
+static enum adc_action an_sample_cb(const struct device *dev, const struct adc_sequence *seq, uint16_t idx);
+struct adc_sequence_options an_options = {
+	.callback		 = an_sample_cb,
+	.extra_samplings = AN_BUF_SIZE - 1,
+};
+struct adc_sequence an_sequence = {
+	.options	 = &an_options,
+	.channels 	 = BIT(ADC_CHANNEL),
+	.buffer		 = an_buf,
+	.buffer_size = sizeof(an_buf),
+	.resolution  = ADC_RESOLUTION
+};
+K_SEM_DEFINE(an_sem, 0, 1);	// Wakes thread2 when the continuous mode is selected
+static uint16_t an_freq;	// anFreq the running continuous sequence was started with
+static atomic_t an_busy;	// Set by thread0 when it hands the ADC and the history over to thread2, cleared once its sequence ended
+
 // Config threads
 #define THREAD0_PRIORITY 7
 #define THREAD1_PRIORITY 7
-K_MUTEX_DEFINE(test_mutex);
+#define THREAD2_PRIORITY 6
+K_MUTEX_DEFINE(test_mutex);	// Subscriptions of the links, the RTDB uses its sequence lock
 
-// Buttons 1-4
-const struct gpio_dt_spec button_1 = GPIO_DT_SPEC_GET_OR(DT_ALIAS(sw0), gpios, {0});
-const struct gpio_dt_spec button_2 = GPIO_DT_SPEC_GET_OR(DT_ALIAS(sw1), gpios, {0});
-const struct gpio_dt_spec button_3 = GPIO_DT_SPEC_GET_OR(DT_ALIAS(sw2), gpios, {0});
-const struct gpio_dt_spec button_4 = GPIO_DT_SPEC_GET_OR(DT_ALIAS(sw3), gpios, {0});
-
-// LEDs 1-4
-const struct gpio_dt_spec led_1 = GPIO_DT_SPEC_GET(DT_ALIAS(led0), gpios);
-const struct gpio_dt_spec led_2 = GPIO_DT_SPEC_GET_OR(DT_ALIAS(led1), gpios, {0});		
-const struct gpio_dt_spec led_3 = GPIO_DT_SPEC_GET_OR(DT_ALIAS(led2), gpios, {0});		
-const struct gpio_dt_spec led_4 = GPIO_DT_SPEC_GET_OR(DT_ALIAS(led3), gpios, {0});		
+// Buttons and LEDs, one entry per RTDB signal (port is NULL for the analog input and for the aliases missing on the board)
+#define SIG_HW(name, kind, bit, alias) {#name, kind, bit, GPIO_DT_SPEC_GET_OR(DT_ALIAS(alias), gpios, {0})},
+static const struct{
+	const char *name;
+	int kind;
+	int bit;
+	struct gpio_dt_spec gpio;
+} signals[SIG_N] = {
+	RTDB_SIGNALS(SIG_HW)
+};
 
 // UART
 #define STACKSIZE 2048
-#define RECEIVE_BUFF_SIZE 20
-#define TRANSMIT_BUFF_SIZE 50
+#define RECEIVE_BUFF_SIZE UART_RX_SIZE
+#define RECEIVE_BUFF_COUNT 4		// RX buffers, one in use by the driver, one queued and the rest being released
 #define RECEIVE_TIMEOUT 100
-const struct device *uart = DEVICE_DT_GET(DT_NODELABEL(uart0));
-static uint8_t tx_buf[TRANSMIT_BUFF_SIZE] = "[UART] This is a UART test msg\n";
-static uint8_t rx_buf[RECEIVE_BUFF_SIZE] = {0};
+#define RX_RETRY_MS 10				// Period the command thread retries a reception the driver could not restart
+
+// Flow control, the host is held while rx_queue is above FRAME_QUEUE_HIGH until it drains to FRAME_QUEUE_LOW
+// With hw-flow-control in the devicetree no RX buffer is given to the driver, so RTS is deasserted,
+// otherwise XOFF/XON are sent between two TX frames, and only in CMD_MODE_ASCII (binary payloads may contain them,
+// binary links that need to hold the host must use RTS/CTS)
+#define XON_SYM 0x11
+#define XOFF_SYM 0x13
+
+// Port serving the command protocol, each one has its own buffers, protocol state and command thread
+typedef struct{
+	const struct device *dev;
+	int rts_cts;				// hw-flow-control set in the devicetree
+	struct k_mem_slab rx_slab;	// Pool of RX buffers handed to the driver
+	uint8_t rx_mem[RECEIVE_BUFF_COUNT * RECEIVE_BUFF_SIZE] __aligned(4);
+	FrameDecoder rx_dec;		// Decoder fed by the UART callback
+	FrameQueue rx_queue;		// Decoded frames waiting for the command thread
+	struct k_sem rx_sem;		// Given by the UART callback when frames were queued, wakes the command thread
+	CmdLink link;				// Protocol state of the port
+	FrameQueue tx_queue;		// Response and push frames waiting for the UART
+	atomic_t tx_busy;			// Set while uart_tx() owns the oldest frame of tx_queue or tx_ctl_buf
+	atomic_t tx_ctl;			// XON_SYM or XOFF_SYM waiting for the current frame to end, 0 if none
+	uint8_t tx_ctl_buf;			// Flow control byte being sent
+	struct k_sem tx_free;		// Free slots of tx_queue
+	struct k_mutex tx_mutex;	// Responses of the command thread and pushes of thread0 share the TX queue
+	atomic_t rx_hold;			// Set while the host is held
+	atomic_t rx_off;			// Set while the reception is disabled (RTS/CTS hold, error or no free RX buffer)
+	uint32_t baud_old;			// Rate restored if the one requested by 'R' gets no valid frame
+	int64_t baud_deadline;		// Uptime in ms the new rate has to be confirmed by, 0 when confirmed
+	atomic_t ready;				// Set once uart_port_init() succeeded
+} UartPort;
+
+// printk writes with uart_poll_out(), on a protocol port it would land between or inside the uart_tx() frames
+#if IS_ENABLED(CONFIG_UART_CONSOLE) && DT_HAS_CHOSEN(zephyr_console) && DT_SAME_NODE(DT_CHOSEN(zephyr_console), DT_NODELABEL(uart0))
+#error "The console shares uart0 with the protocol, move it in the board conf (see boards/)"
+#endif
+
+#define PORT_DT(node) {.dev = DEVICE_DT_GET(node), .rts_cts = DT_PROP_OR(node, hw_flow_control, 0)}
+#define PORT_ENTRY(node, prop, idx) PORT_DT(DT_PHANDLE_BY_IDX(node, prop, idx)),
+
+// uart0 is the production master, a board overlay lists every port (second UART, CDC-ACM or native_sim pty)
+// with: zephyr,user { ncs-ports = <&uart0 &node ...>; }; (see boards/), each port gets its own command thread
+static UartPort ports[] = {
+#if DT_NODE_HAS_PROP(DT_PATH(zephyr_user), ncs_ports)
+	DT_FOREACH_PROP_ELEM(DT_PATH(zephyr_user), ncs_ports, PORT_ENTRY)
+#else
+	PORT_DT(DT_NODELABEL(uart0)),
+#endif
+};
+K_THREAD_STACK_ARRAY_DEFINE(port_stacks, ARRAY_SIZE(ports), STACKSIZE);
+static struct k_thread port_threads[ARRAY_SIZE(ports)];
+
+#ifdef CONFIG_UART_ASYNC_ADAPTER
+UART_ASYNC_ADAPTER_INST_DEFINE(async_adapter);	// Async API on top of one interrupt driven port (CDC-ACM)
+#endif
 
 // Vars
 RTDB database;
@@ -83,50 +163,357 @@ void updateFreq(int x){
 	period = x;
 }
 
-// UART Call-back, in case the buffer gets full. rx_buf will act as a circular buffer
+// Changes the baud rate keeping the rest of the UART configuration
+static int uart_set_baud(UartPort *port, uint32_t baud){
+	struct uart_config cfg;
+	int err = uart_config_get(port->dev, &cfg);
+
+	if(err){
+		return err;
+	}
+	cfg.baudrate = baud;
+
+	return uart_configure(port->dev, &cfg);
+}
+
+// Starts the transmission of the pending flow control byte or of the oldest queued frame, only called by the owner of tx_busy
+static void uart_tx_next(UartPort *port){
+	const char *frame;
+	int len;
+
+	port->tx_ctl_buf = atomic_set(&port->tx_ctl, 0);
+	if(port->tx_ctl_buf && uart_tx(port->dev, &port->tx_ctl_buf, 1, SYS_FOREVER_US) == 0){
+		return;	// Never inside a frame, UART_TX_DONE chains the frames
+	}
+	while((frame = frameQueuePeek(&port->tx_queue, &len)) != NULL){
+		if(uart_tx(port->dev, (const uint8_t *)frame, len, SYS_FOREVER_US) == 0){
+			return;	// UART_TX_DONE chains the next one
+		}
+		frameQueueRelease(&port->tx_queue);	// Driver error, drop the frame
+		k_sem_give(&port->tx_free);
+	}
+	atomic_clear(&port->tx_busy);
+	// A frame or a flow control byte queued after the last check would wait for a transmission that is not running
+	if((frameQueuePeek(&port->tx_queue, &len) != NULL || atomic_get(&port->tx_ctl)) && atomic_cas(&port->tx_busy, 0, 1)){
+		uart_tx_next(port);
+	}
+}
+
+// Reserves the next TX slot, the response or push frame is written in place and sent by uart_commit()
+static uint8_t *uart_reserve(UartPort *port){
+	int full = k_sem_take(&port->tx_free, K_NO_WAIT) != 0;
+
+	if(full){
+		k_sem_take(&port->tx_free, K_FOREVER);	// Wait for a free slot
+	}
+	k_mutex_lock(&port->tx_mutex, K_FOREVER);		// Held until uart_commit()
+	port->link.stat[CMD_STAT_TX_FULL] += full;
+
+	return (uint8_t *)frameQueueReserve(&port->tx_queue);
+}
+
+// Same as uart_reserve() without waiting, used by thread0 so a stalled TX never delays the RTDB refresh
+static uint8_t *uart_try_reserve(UartPort *port){
+	if(k_sem_take(&port->tx_free, K_NO_WAIT) != 0){
+		port->link.stat[CMD_STAT_TX_FULL]++;	// The push is retried on the next refresh
+		return NULL;
+	}
+	if(k_mutex_lock(&port->tx_mutex, K_NO_WAIT) != 0){	// A response is being built
+		k_sem_give(&port->tx_free);
+		return NULL;
+	}
+
+	return (uint8_t *)frameQueueReserve(&port->tx_queue);
+}
+
+// Sends the len bytes written in the reserved slot, the UART sends them while the caller goes on
+static void uart_commit(UartPort *port, int len){
+	if(len > 0){
+		frameQueueCommit(&port->tx_queue, len);
+	} else{
+		k_sem_give(&port->tx_free);				// Nothing to send, the slot is reused
+	}
+	k_mutex_unlock(&port->tx_mutex);
+	if(len > 0 && atomic_cas(&port->tx_busy, 0, 1)){
+		uart_tx_next(port);
+	}
+}
+
+// Queues XON_SYM or XOFF_SYM, sent as soon as the frame being transmitted ends
+static void uart_flow_send(UartPort *port, uint8_t sym){
+	atomic_set(&port->tx_ctl, sym);
+	if(atomic_cas(&port->tx_busy, 0, 1)){
+		uart_tx_next(port);
+	}
+}
+
+// Takes a buffer from the pool and starts the reception on it
+static int uart_rx_start(UartPort *port){
+	uint8_t *buf;
+
+	if(k_mem_slab_alloc(&port->rx_slab, (void **)&buf, K_NO_WAIT) != 0){
+		return -ENOMEM;
+	}
+	return uart_rx_enable(port->dev, buf, RECEIVE_BUFF_SIZE, RECEIVE_TIMEOUT);
+}
+
+// Restarts a disabled reception, on failure rx_off stays set and the command thread retries every RX_RETRY_MS
+static int uart_rx_restart(UartPort *port){
+	int err;
+
+	if(!atomic_cas(&port->rx_off, 1, 0)){	// Not disabled, or restarted by the other context
+		return 0;
+	}
+	err = uart_rx_start(port);
+	if(err){
+		port->link.stat[CMD_STAT_RX_OVERRUN]++;
+		atomic_set(&port->rx_off, 1);
+	}
+
+	return err;
+}
+
+// Only RTS/CTS holds the host by leaving the reception disabled, with XON/XOFF it restarts right away
+static int uart_rx_held(UartPort *port){
+	return port->rts_cts && atomic_get(&port->rx_hold);
+}
+
+// Lets the host send again once the command thread has drained rx_queue, and restarts a reception that stopped
+static void uart_rx_resume(UartPort *port){
+	if(frameQueueLevel(&port->rx_queue) <= FRAME_QUEUE_LOW && atomic_cas(&port->rx_hold, 1, 0) && !port->rts_cts){
+		uart_flow_send(port, XON_SYM);	// Also after a switch to binary mode, the host would be held forever
+	}
+	if(!uart_rx_held(port)){	// If RX is not disabled yet the callback restarts it
+		uart_rx_restart(port);
+	}
+}
+
+// UART Call-back, received bytes are decoded as they arrive and complete frames are queued for the command thread
+// The driver always has the next RX buffer queued (UART_RX_BUF_REQUEST), so it switches buffers without a gap
 static void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data){
+	UartPort *port = user_data;
+	uint8_t *buf;
+
 	switch(evt->type){
 		case UART_TX_DONE:
+		case UART_TX_ABORTED:
+			if(evt->data.tx.buf != &port->tx_ctl_buf){
+				frameQueueRelease(&port->tx_queue);
+				k_sem_give(&port->tx_free);
+			}
+			uart_tx_next(port);
+			break;
+		case UART_RX_RDY:
+			if(frameFeed(&port->rx_dec, &port->rx_queue, &evt->data.rx.buf[evt->data.rx.offset], evt->data.rx.len) > 0){
+				k_sem_give(&port->rx_sem);
+			}
+			if(!port->rts_cts && port->link.mode == CMD_MODE_ASCII && frameQueueLevel(&port->rx_queue) >= FRAME_QUEUE_HIGH &&
+				atomic_cas(&port->rx_hold, 0, 1)){
+				uart_flow_send(port, XOFF_SYM);
+			}
+			break;
+		case UART_RX_BUF_REQUEST:
+			if(port->rts_cts && frameQueueLevel(&port->rx_queue) >= FRAME_QUEUE_HIGH){
+				atomic_set(&port->rx_hold, 1);	// The current buffer is the last one, RTS drops when it is full
+			} else if(k_mem_slab_alloc(&port->rx_slab, (void **)&buf, K_NO_WAIT) == 0){
+				uart_rx_buf_rsp(dev, buf, RECEIVE_BUFF_SIZE);
+			} else{
+				port->link.stat[CMD_STAT_RX_OVERRUN]++;	// Reception stops until a buffer is released
+			}
+			break;
+		case UART_RX_STOPPED:
+			if(evt->data.rx_stop.reason == UART_ERROR_OVERRUN){
+				port->link.stat[CMD_STAT_RX_OVERRUN]++;
+			}
 			break;
-		case UART_RX_DISABLED:
-			uart_rx_enable(dev, rx_buf, sizeof rx_buf, RECEIVE_TIMEOUT);
+		case UART_RX_BUF_RELEASED:
+			k_mem_slab_free(&port->rx_slab, evt->data.rx_buf.buf);
+			break;
+		case UART_RX_DISABLED: // Only when the driver ran out of buffers, stopped on an error or the host is held
+			atomic_set(&port->rx_off, 1);
+			if(!uart_rx_held(port) && uart_rx_restart(port)){
+				k_sem_give(&port->rx_sem);	// The command thread retries the restart
+			}
 			break;
 		default:
 			break;
 	}
 }
 
+// Sets up the buffers and the protocol state of a port and starts the reception
+static int uart_port_init(UartPort *port){
+	int err;
+
+	if(!device_is_ready(port->dev)){
+		return -ENODEV;
+	}
+	k_mem_slab_init(&port->rx_slab, port->rx_mem, RECEIVE_BUFF_SIZE, RECEIVE_BUFF_COUNT);
+	k_sem_init(&port->rx_sem, 0, 1);
+	k_sem_init(&port->tx_free, FRAME_QUEUE_LEN, FRAME_QUEUE_LEN);
+	k_mutex_init(&port->tx_mutex);
+	cmdLinkInit(&port->link);
+	frameDecoderInit(&port->rx_dec, &port->link);
+	frameQueueInit(&port->rx_queue);
+	frameQueueInit(&port->tx_queue);
+	err = uart_callback_set(port->dev, uart_cb, port);
+#ifdef CONFIG_UART_ASYNC_ADAPTER
+	static int adapter_used;
+
+	if(err == -ENOSYS && !adapter_used){	// Interrupt driven only, served through the adapter
+		adapter_used = 1;
+		uart_async_adapter_init(async_adapter, port->dev);
+		port->dev = async_adapter;
+		err = uart_callback_set(port->dev, uart_cb, port);
+	}
+#endif
+	if(!err){
+		err = uart_rx_start(port);
+	}
+	atomic_set(&port->ready, !err);
+
+	return err;
+}
+
+// Applies the configuration stored before the reset
+static void config_restore(void){
+	StoreCfg cfg = {period, AN_FREQ_DEFAULT, AN_MODE_SINGLE, 0};	// Defaults when nothing is stored
+
+	storeInit(&cfg);
+	period = cfg.period;
+	database.anFreq = cfg.anFreq;
+	database.anMode = cfg.anMode;
+	atomic_set(&database.io, cfg.leds & RTDB_LED_MASK);	// Driven by the first refresh
+}
+
 // Thread de atualização da RTDB
 void thread0(void){
     initRTDB(&database);
+	config_restore();
 	int err;
-	k_busy_wait(50000); // Wait for TH1 to initilize Hardware
+	uint8_t *push;		// TX slot of a push frame
+	int64_t next;		// Absolute deadline of the cycle in ticks
+	RTDB snap;			// Copy of the RTDB used while the hardware is accessed
+	long io;			// LEDs to write and buttons published in this cycle
+	long buts;			// Buttons read in this cycle
+	long io_last = 0;	// LEDs and buttons of the previous cycle
+	int an_last = 0;	// Analog value of the previous cycle
+	int an_single;		// thread0 owns the ADC and the history in this cycle
+	StoreCfg cfg;		// Configuration kept across resets
+	int late;			// Start of the cycle after its deadline in us
+	k_sleep(K_MSEC(50)); // Wait for TH1 to initilize Hardware
 	printk("[TH0] Ready\n");
+	next = k_uptime_ticks();
 	while(1){
-		err = adc_read(adc_dev, &sequence);
-		if(err != 0){
-			printk("ADC reading failed with error %d. \n", err);
+		late = k_ticks_to_us_near64(k_uptime_ticks() - next);
+
+		// While thread2 samples continuously it is the only writer of anRaw and of the history
+		an_single = !atomic_get(&an_busy) && database.anMode == AN_MODE_SINGLE;
+		if(an_single){
+			err = adc_read(adc_dev, &sequence);
+			if(err != 0){
+				printk("ADC reading failed with error %d. \n", err);
+			}
+		} else if(atomic_cas(&an_busy, 0, 1)){
+			k_sem_give(&an_sem);	// thread2 owns the ADC until it clears an_busy
 		}
 
-		k_mutex_lock(&test_mutex, K_FOREVER);	// Refreshing the RTDB Lock the access
-
-		// Buttons
-		database.but[0] = gpio_pin_get_dt(&button_1);
-		database.but[1] = gpio_pin_get_dt(&button_2);
-		database.but[2] = gpio_pin_get_dt(&button_3);
-		database.but[3] = gpio_pin_get_dt(&button_4);
-		// LEDs
-		gpio_pin_set_dt(&led_1, database.led[0]);
-		gpio_pin_set_dt(&led_2, database.led[1]);
-		gpio_pin_set_dt(&led_3, database.led[2]);
-		gpio_pin_set_dt(&led_4, database.led[3]);
+		// The hardware is accessed on a snapshot, only the stores are done in the write section
+		rtdbRead(&database, &snap);
+		// Buttons and LEDs
+		io = atomic_get(&database.io);
+		buts = 0;
+		for(int id = 0; id < SIG_N; id++){
+			if(signals[id].gpio.port == NULL){
+				continue;
+			}
+			if(signals[id].kind == SIG_DIN){
+				buts |= (long)(gpio_pin_get_dt(&signals[id].gpio) > 0) << signals[id].bit;
+			} else if(signals[id].kind == SIG_DOUT){
+				gpio_pin_set_dt(&signals[id].gpio, (io >> signals[id].bit) & 1);
+			}
+		}
+		atomic_xor(&database.io, (io ^ buts) & RTDB_BUT_MASK);	// Only thread0 writes the button bits, 'L' may flip LEDs meanwhile
 		// Analog Read
-		database.anRaw = sample_buffer[0];
-		database.anVal = (float)database.anRaw * 3/(pow(2, ADC_RESOLUTION)); // Swaping scales where 3 = VDD
+		if(an_single){
+			snap.anRaw = sample_buffer[0];
+		}
+
+		rtdbWriteBegin(&database);				// Readers retry instead of waiting
+		if(an_single){
+			database.anRaw = snap.anRaw;
+		}
+		// Jitter
+		database.jitLast = late;
+		database.jitMax = late > database.jitMax ? late : database.jitMax;
+		rtdbWriteEnd(&database);
+		if(an_single){
+			rtdbHistPush(&database, k_uptime_get_32(), snap.anRaw);	// Lock free, read back with 'Y'
+		}
+
+		// New generation for the groups that really changed, read back with 'D'
+		io = (io & RTDB_LED_MASK) | buts;
+		if((io ^ io_last) & RTDB_BUT_MASK){
+			rtdbTouch(&database, RTDB_GRP_BUT);
+		}
+		if((io ^ io_last) & RTDB_LED_MASK){
+			rtdbTouch(&database, RTDB_GRP_LED);
+		}
+		if(snap.anRaw != an_last){
+			rtdbTouch(&database, RTDB_GRP_AN);
+		}
+		io_last = io;
+		an_last = snap.anRaw;
+
+		// Configuration written to flash a while after it changes
+		cfg = (StoreCfg){period, snap.anFreq, snap.anMode, io & RTDB_LED_MASK};
+		storeSave(&cfg);
+
+		// Push the subscribed signals that changed, each frame is built in a TX slot of its port
+		for(int i = 0; i < ARRAY_SIZE(ports); i++){
+			if(!atomic_get(&ports[i].ready)){
+				continue;
+			}
+			while(cmdPush(&ports[i].link, &database, k_uptime_get_32(), NULL) > 0){
+				push = uart_try_reserve(&ports[i]);
+				if(push == NULL){	// TX stalled (CTS, XOFF or a baud switch), the refresh does not wait for it
+					break;
+				}
+				uart_commit(&ports[i], cmdPush(&ports[i].link, &database, k_uptime_get_32(), push));
+			}
+		}
+
+		// Sleep until the next deadline, the period does not drift with the time the cycle took
+		next += k_us_to_ticks_ceil64(period);
+		if(next < k_uptime_ticks()){	// Cycle longer than the period (or 'U' shortened it), start over from now
+			next = k_uptime_ticks();
+		}
+		k_sleep(K_TIMEOUT_ABS_TICKS(next));
+	}
+}
 
-		k_mutex_unlock(&test_mutex);			// Refresh done, time to unlock
+// Called by the ADC driver after every sample of the continuous mode
+static enum adc_action an_sample_cb(const struct device *dev, const struct adc_sequence *seq, uint16_t idx){
+	database.anRaw = an_buf[idx];	// Single store, no write section needed
+	rtdbHistPush(&database, k_uptime_get_32(), an_buf[idx]);	// Every sample, thread0 stays off the history until an_busy is cleared
+	// 'P' and 'S' take effect on the next sample instead of at the end of the AN_BUF_SIZE samples
+	return database.anMode == AN_MODE_CONT && database.anFreq == an_freq ? ADC_ACTION_CONTINUE : ADC_ACTION_FINISH;
+}
 
-		k_busy_wait(period);
+// Thread de amostragem contínua da entrada analógica
+void thread2(void){
+	int err;
+	while(1){
+		k_sem_take(&an_sem, K_FOREVER);	// Handed over by thread0
+		while(database.anMode == AN_MODE_CONT){
+			an_freq = database.anFreq;							// 'S' may have changed it
+			an_options.interval_us = 1000000 / an_freq;
+			err = adc_read(adc_dev, &an_sequence);				// Fills an_buf, one sample every interval_us
+			if(err != 0){
+				printk("ADC continuous reading failed with error %d. \n", err);
+				k_sleep(K_MSEC(100));
+			}
+		}
+		atomic_clear(&an_busy);	// Sequence ended, thread0 takes the ADC and the history back
 	}
 }
 
@@ -136,214 +523,134 @@ void thread0(void){
 	// # L [1/2/3/4] [CS] ! 		- Toggle LED state (Ligado ou desligado)
 	// # A [CS] ! 					- Read Analog sensor (Temperatura)
 	// # U [00] [CS] !	 			- Change frequecy of update of the in/out digital signals of RTDB
-	// So fiz os de cima
 	// # S [0000] [CS] ! 			- Change frequecy of sampling of analog input signal
 	// # P [CS] ! 					- Toggle Analog reading mode
-void thread1(void){
-	if(!initHardware()){
-        printk("[TH1] Error initilizing Hardware\n");
-    }
-	int endSym = 0; 	// Holds the position of the EOF_SYM (!)
-	int startSym = 0;	// Holds the position of the SOF_SYM (#)
-	int flag = 0;		// Goes to 1 if a # and ! are found
+	// # M [0/1] [CS] !				- Switch between ASCII only and binary frames
+	// # K [0/1/2] [CS] !			- Select the frame check (sum, CRC-16 or CRC-32)
+	// # X [CMD DATA]... [CS] !		- Batch of the commands above
+	// # W [0/1] [0/1] [dddd] [iiii] [CS] !	- Subscribe to the buttons or analog input, pushed by thread0
+	// # Q [ii] [CS] !				- Read the link counters ii to ii+2
+	// # T [CS] !					- Read the jitter of the RTDB refresh
+	// # R [bbbbbbb] [CS] !			- Switch the baud rate, restored if no frame arrives at the new one
+	// # @ [TT] [CMD DATA] [CS] !	- Any command tagged, TT is echoed in the response
+// Every port runs this loop in its own thread, all at THREAD1_PRIORITY so the time slicing
+// shares the CPU fairly, the RTDB is read through snapshots that never wait for thread0
+static void port_run(UartPort *port){
 	int err = 0;		// Error var handler
-	char resp[RECEIVE_BUFF_SIZE];	// Response command
-	char cmd[RECEIVE_BUFF_SIZE] = "\0";	// Received command
-	char c = '0';		// Dummy char
-	memset(rx_buf, 0, sizeof(rx_buf));
-	memset(tx_buf, 0, sizeof(tx_buf));
+	int len = 0;		// Length of the received command
+	int baud = 0;		// Baud rate requested by 'R'
+	struct uart_config cfg;
+	uint8_t *resp;					// Response command, written in place in a TX slot
+	const char *cmd;				// Received command, used in place in its RX slot
+
+	if(!atomic_get(&port->ready)){	// uart_port_init() failed or never ran, rx_sem is not initialized
+		printk("[NCS] UART %s not ready, its commands are not served\n", port->dev->name);
+		return;
+	}
 
-	printk("[TH1] Ready\n");
     while(1){
-		endSym = 0; startSym = 0; flag = 0; // Clear all vars 
-		
-		// Look for a EOF_SYM and store its position
-		// if found look for a SOF_SYM and store its position
-		// if also found means theres a possible command in the buffer so set flag to 1
-		// It also takes into account that rx_buf is circular
-		for(int i = 0; i < RECEIVE_BUFF_SIZE; i++){
-			if(rx_buf[i] == EOF_SYM){
-				endSym = i;
-				startSym = endSym;
-				for(int j = 0; j < RECEIVE_BUFF_SIZE; j++){
-					if(rx_buf[startSym] == SOF_SYM){
-						flag = 1;
-						break;
-					}
-					startSym--;
-					startSym = startSym == -1 ? RECEIVE_BUFF_SIZE-1 : startSym;
-				}
-				break;
+		// Proccess every frame the UART callback has decoded since the last wake up
+		while((cmd = frameQueuePeek(&port->rx_queue, &len)) != NULL){
+			resp = uart_reserve(port);
+			err = cmdProcess(&port->link, (const uint8_t *)cmd, len, resp, &database);
+			uart_commit(port, err);
+			frameQueueRelease(&port->rx_queue);
+			if(err < 0){
+				consoleLog(err);
+			} else if(port->baud_deadline){	// A valid frame at the new rate keeps it
+				port->baud_deadline = 0;
 			}
 		}
+		uart_rx_resume(port);
 
-		// If theres a command start processing
-		if(flag == 1){
-			// Next for loop creates a substring from the rx_buf with only the Command chars (from # to !)
-			for(int i = startSym; i != endSym+1; i++){
-				if(i == RECEIVE_BUFF_SIZE){
-					i = 0;
-				}
-				c = rx_buf[i];
-				strncat(cmd, &c, 1);
-				rx_buf[i] = 'X'; // Mark the command in rx_buf with X's
+		// Switch the baud rate once the 'r' response has left at the old one
+		baud = port->link.baud;
+		port->link.baud = 0;
+		if(baud && uart_config_get(port->dev, &cfg) == 0){
+			do{
+				k_sleep(K_MSEC(1));	// Also lets the last byte out of the shift register
+			} while(atomic_get(&port->tx_busy));
+			port->baud_old = cfg.baudrate;
+			if(uart_set_baud(port, baud) == 0){
+				port->baud_deadline = k_uptime_get() + BAUD_TIMEOUT_MS;
 			}
+		}
+		if(port->baud_deadline && k_uptime_get() > port->baud_deadline){
+			printk("[%s] No frame at the new baud rate, back to %u\n", port->dev->name, port->baud_old);
+			uart_set_baud(port, port->baud_old);
+			port->baud_deadline = 0;
+		}
 
-			// Add a NULL terminator to finalize the string
-			if(endSym > startSym){
-				cmd[endSym+1] = '\0';
-			}
-			else{
-				cmd[RECEIVE_BUFF_SIZE-startSym+endSym+1] = '\0';
-			}
+		// Block until the callback queues a frame, until the new baud rate times out or, with the reception stopped, until the restart is retried
+		if(atomic_get(&port->rx_off) && !uart_rx_held(port)){
+			k_sem_take(&port->rx_sem, K_MSEC(RX_RETRY_MS));
+		} else{
+			k_sem_take(&port->rx_sem, port->baud_deadline ? K_TIMEOUT_ABS_MS(port->baud_deadline + 1) : K_FOREVER);
+		}
+    }
+}
 
-			// Proccess the command
-			err = cmdProcessor(cmd, resp, &database);
-			if(err == SUCCESS){
-				strcpy(tx_buf, resp);
-				printk("%s\n", tx_buf); // uart_tx(uart, tx_buf, sizeof(tx_buf), SYS_FOREVER_MS); does not work as expected for some reason
-			} else{
-				consoleLog(err);
-			}
+// Command thread of a port
+static void port_thread(void *p1, void *p2, void *p3){
+	port_run(p1);
+}
 
-			memset(cmd, 0, sizeof(cmd));
-			memset(tx_buf, 0, sizeof(cmd));
-			flag = 0;	// Command was processed so set the flag to zero again
-		}
-		
-		// for(int i = 0; i < RECEIVE_BUFF_SIZE; i++){
-		// 	printk("%c", rx_buf[i]);
-		// }
-		// printk("\n");
-		k_busy_wait(5000);
+// Sets up the hardware, then starts the command threads of all the ports together
+void thread1(void){
+	if(!initHardware()){
+        printk("[TH1] Error initilizing Hardware\n");
     }
+	for(int i = 0; i < ARRAY_SIZE(ports); i++){
+		k_thread_create(&port_threads[i], port_stacks[i], K_THREAD_STACK_SIZEOF(port_stacks[i]), port_thread,
+			&ports[i], NULL, NULL, THREAD1_PRIORITY, 0, K_NO_WAIT);
+	}
+
+	printk("[TH1] Ready, %d ports\n", (int)ARRAY_SIZE(ports));
 }
 
 K_THREAD_DEFINE(thread0_id, STACKSIZE, thread0, NULL, NULL, NULL, THREAD0_PRIORITY, 0, 0);
 K_THREAD_DEFINE(thread1_id, STACKSIZE, thread1, NULL, NULL, NULL, THREAD1_PRIORITY, 0, 0);
+K_THREAD_DEFINE(thread2_id, STACKSIZE, thread2, NULL, NULL, NULL, THREAD2_PRIORITY, 0, 0);
 
 int initHardware(){
     int returnValue = 0;
 
-	// Check if the buttons are ready
-	if(!gpio_is_ready_dt(&button_1)){
-		printk("[NCS] Error: button device %s is not ready\n", button_1.port->name);
-		return 0;
-	}
-	if(!gpio_is_ready_dt(&button_2)){
-		printk("[NCS] Error: button device %s is not ready\n", button_2.port->name);
-		return 0;
-	}
-	if(!gpio_is_ready_dt(&button_3)){
-		printk("[NCS] Error: button device %s is not ready\n", button_3.port->name);
-		return 0;
-	}
-	if(!gpio_is_ready_dt(&button_4)){
-		printk("[NCS] Error: button device %s is not ready\n", button_4.port->name);
-		return 0;
-	}
-	
-	// Configure the buttons as inputs
-	returnValue = gpio_pin_configure_dt(&button_1, GPIO_INPUT);
-	if(returnValue != 0){
-		printk("[NCS] Error %d: failed to configure %s pin %d\n", returnValue, button_1.port->name, button_1.pin);
-		return 0;
-	}
-	returnValue = gpio_pin_configure_dt(&button_2, GPIO_INPUT);
-	if(returnValue != 0){
-		printk("[NCS] Error %d: failed to configure %s pin %d\n", returnValue, button_2.port->name, button_2.pin);
-		return 0;
-	}
-	returnValue = gpio_pin_configure_dt(&button_3, GPIO_INPUT);
-	if(returnValue != 0){
-		printk("[NCS] Error %d: failed to configure %s pin %d\n", returnValue, button_3.port->name, button_3.pin);
-		return 0;
-	}
-	returnValue = gpio_pin_configure_dt(&button_4, GPIO_INPUT);
-	if(returnValue != 0){
-		printk("[NCS] Error %d: failed to configure %s pin %d\n", returnValue, button_4.port->name, button_4.pin);
-		return 0;
-	}
-	printk("[NCS] Set up button_1 at %s pin %d\n", button_1.port->name, button_1.pin);
-	printk("[NCS] Set up button_2 at %s pin %d\n", button_2.port->name, button_2.pin);
-	printk("[NCS] Set up button_3 at %s pin %d\n", button_3.port->name, button_3.pin);
-	printk("[NCS] Set up button_4 at %s pin %d\n", button_4.port->name, button_4.pin);
-
-	// Check if the LEDs are ready
-	if(led_1.port && !gpio_is_ready_dt(&led_1)){
-		printk("[NCS] Error %d: LED_1 device %s is not ready\n", returnValue, led_1.port->name);
-		return 0;
-	}
-	if(led_2.port && !gpio_is_ready_dt(&led_2)){
-		printk("[NCS] Error %d: LED_2 device %s is not ready\n", returnValue, led_2.port->name);
-		return 0;
-	}
-	if(led_3.port && !gpio_is_ready_dt(&led_3)){
-		printk("[NCS] Error %d: LED_3 device %s is not ready\n", returnValue, led_3.port->name);
-		return 0;
-	}
-	if(led_4.port && !gpio_is_ready_dt(&led_4)){
-		printk("[NCS] Error %d: LED_4 device %s is not ready\n", returnValue, led_4.port->name);
-		return 0;
-	}
+	// Buttons as inputs and LEDs as outputs turned off
+	for(int id = 0; id < SIG_N; id++){
+		const struct gpio_dt_spec *gpio = &signals[id].gpio;
 
-	// Configuring LEDs as outputs
-	returnValue = gpio_pin_configure_dt(&led_1, GPIO_OUTPUT);
-	if(returnValue != 0){
-		printk("[NCS] Error %d: failed to configure LED_1 device %s pin %d\n", returnValue, led_1.port->name, led_1.pin);
-		return 0;
-	} else{
-		printk("[NCS] Set up LED_1 at %s pin %d\n", led_1.port->name, led_1.pin);
-	}
-	returnValue = gpio_pin_configure_dt(&led_2, GPIO_OUTPUT);
-	if(returnValue != 0){
-		printk("[NCS] Error %d: failed to configure LED_1 device %s pin %d\n", returnValue, led_2.port->name, led_2.pin);
-		return 0;
-	} else{
-		printk("[NCS] Set up LED_2 at %s pin %d\n", led_2.port->name, led_2.pin);
-	}
-	returnValue = gpio_pin_configure_dt(&led_3, GPIO_OUTPUT);
-	if(returnValue != 0){
-		printk("[NCS] Error %d: failed to configure LED_1 device %s pin %d\n", returnValue, led_3.port->name, led_3.pin);
-		return 0;
-	} else{
-		printk("[NCS] Set up LED_3 at %s pin %d\n", led_3.port->name, led_3.pin);
-	}
-	returnValue = gpio_pin_configure_dt(&led_4, GPIO_OUTPUT);
-	if(returnValue != 0){
-		printk("[NCS] Error %d: failed to configure LED_1 device %s pin %d\n", returnValue, led_4.port->name, led_4.pin);
-		return 0;
-	} else{
-		printk("[NCS] Set up LED_4 at %s pin %d\n", led_4.port->name, led_4.pin);
+		if(gpio->port == NULL){ // Analog input or not wired on this board
+			continue;
+		}
+		if(!gpio_is_ready_dt(gpio)){
+			printk("[NCS] Error: %s device %s is not ready\n", signals[id].name, gpio->port->name);
+			return 0;
+		}
+		returnValue = gpio_pin_configure_dt(gpio, signals[id].kind == SIG_DIN ? GPIO_INPUT : GPIO_OUTPUT_INACTIVE);
+		if(returnValue != 0){
+			printk("[NCS] Error %d: failed to configure %s device %s pin %d\n", returnValue, signals[id].name, gpio->port->name, gpio->pin);
+			return 0;
+		}
+		printk("[NCS] Set up %s at %s pin %d\n", signals[id].name, gpio->port->name, gpio->pin);
 	}
 
-	// Turning LEDs off
-	gpio_pin_set_dt(&led_1, 0);
-	gpio_pin_set_dt(&led_2, 0);
-	gpio_pin_set_dt(&led_3, 0);
-	gpio_pin_set_dt(&led_4, 0);
-
-    // Check if UART is ready
-    if(!device_is_ready(uart)){
-        printk("[NCS] Error: UART device not ready\n");
-    }
-    printk("[NCS] Device UART ready\n");
-	returnValue = uart_callback_set(uart, uart_cb, NULL);
-	if(returnValue){
-		printk("[NCS] Error: Failled to set up UART callback\n");
-		return 0;
-	}
-	returnValue = uart_tx(uart, tx_buf, sizeof(tx_buf), SYS_FOREVER_MS);
+#ifdef CONFIG_USB_DEVICE_STACK
+	// CDC-ACM ports only exist once the USB device stack is up
+	returnValue = usb_enable(NULL);
 	if(returnValue){
-		printk("[NCS] Error: Failled to send TX buffer\n");
-		return 0;
+		printk("[NCS] Error %d: Failled to enable USB\n", returnValue);
 	}
-	returnValue = uart_rx_enable(uart, rx_buf, sizeof(rx_buf), RECEIVE_TIMEOUT);
-	if(returnValue){
-		printk("[NCS] Error: Failled to set up UART\n");
-		return 0;
+#endif
+
+    // Set up the UART ports, a port that fails is left out (ready stays clear) and the rest of the hardware still comes up
+	for(int i = 0; i < ARRAY_SIZE(ports); i++){
+		returnValue = uart_port_init(&ports[i]);
+		if(returnValue){
+			printk("[NCS] Error %d: Failled to set up UART %s, port not served\n", returnValue, ports[i].dev->name);
+			continue;
+		}
+		printk("[NCS] UART device %s ready\n", ports[i].dev->name);
 	}
-	printk("[NCS] UART device ready\n");
 
 	// Check if ADC is ready
 	if(!device_is_ready(adc_dev)){
@@ -0,0 +1,112 @@
+/** @file store.c
+ * @brief Implementation of the persistent configuration
+ *
+ * @author Gonçalo Peralta & João Alvares
+ * @date 17 October 2026
+ * @bug No known bugs.
+*/
+#include <string.h>
+
+#include "../includes/store.h"
+#include "../includes/funcs.h"
+
+int storeCfgLoad(StoreCfg *cfg, const void *data, int len){
+	StoreCfg tmp = *cfg;
+
+	memcpy(&tmp, data, len < (int)sizeof(tmp) ? len : (int)sizeof(tmp));	// Newer fields keep their default
+	if(tmp.period <= 0 || tmp.anFreq < 1 || tmp.anFreq > AN_FREQ_MAX || (tmp.anMode != AN_MODE_SINGLE && tmp.anMode != AN_MODE_CONT)){
+		return 0;
+	}
+	*cfg = tmp;
+
+	return 1;
+}
+
+#ifdef __ZEPHYR__
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/printk.h>
+
+static StoreCfg storeLoaded;	// Filled by storeSet() while the settings are loaded
+static StoreCfg storeCur;		// Latest values given to storeSave()
+static StoreCfg storeSaved;		// Values in flash
+static int storeCount;			// Flash writes since boot
+static struct k_spinlock storeLock;	// storeCur is written by thread0 and read by the system workqueue
+
+// Called by settings_load_subtree() for every key under "ncs"
+static int storeSet(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg){
+	uint8_t buf[64];
+	int n;
+
+	if(strcmp(name, "cfg") != 0){
+		return -ENOENT;
+	}
+	if(len > sizeof(buf)){
+		return -EINVAL;
+	}
+	n = read_cb(cb_arg, buf, len);
+	if(n < 0){
+		return n;
+	}
+	if(!storeCfgLoad(&storeLoaded, buf, n)){
+		printk("[STORE] Stored configuration out of range, defaults kept\n");
+	}
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(ncs, "ncs", NULL, storeSet, NULL, NULL);
+
+// Writes the latest configuration if it differs from the one in flash
+static void storeWrite(struct k_work *work){
+	k_spinlock_key_t key = k_spin_lock(&storeLock);
+	StoreCfg cfg = storeCur;
+	int err;
+
+	k_spin_unlock(&storeLock, key);
+	if(memcmp(&cfg, &storeSaved, sizeof(cfg)) == 0){ // Changed back before the deadline
+		return;
+	}
+	err = settings_save_one(STORE_KEY, &cfg, sizeof(cfg));
+	if(err){
+		printk("[STORE] Error %d: failed to save the configuration\n", err);
+		return;
+	}
+	storeSaved = cfg;
+	storeCount++;
+}
+
+static K_WORK_DELAYABLE_DEFINE(storeWork, storeWrite);
+
+int storeInit(StoreCfg *cfg){
+	int err = settings_subsys_init();
+
+	storeLoaded = *cfg;
+	if(err == 0){
+		err = settings_load_subtree("ncs");
+	}
+	if(err){
+		printk("[STORE] Error %d: settings not available, defaults used\n", err);
+	}
+	*cfg = storeLoaded;
+	storeCur = storeLoaded;
+	storeSaved = storeLoaded;
+
+	return err;
+}
+
+void storeSave(const StoreCfg *cfg){
+	k_spinlock_key_t key;
+
+	if(memcmp(cfg, &storeCur, sizeof(*cfg)) == 0){ // Only thread0 writes storeCur, no lock needed to compare
+		return;
+	}
+	key = k_spin_lock(&storeLock);
+	storeCur = *cfg;
+	k_spin_unlock(&storeLock, key);
+	k_work_schedule(&storeWork, K_MSEC(STORE_DELAY_MS));	// No effect while a write is pending
+}
+
+int storeWrites(void){
+	return storeCount;
+}
+#endif
@@ -11,11 +11,28 @@
 #ifndef CMD_PROC_H_
 #define CMD_PROC_H_
 
-#define UART_RX_SIZE 20 	/**< Maximum size of the RX buffer */ 
-#define UART_TX_SIZE 20 	/**< Maximum size of the TX buffer */ 
+#define UART_RX_SIZE 64 	/**< Maximum size of the RX buffer */ 
+#define UART_TX_SIZE 64 	/**< Maximum size of the TX buffer */ 
 #define SOF_SYM '#'	        /**< Start of Frame Symbol */
 #define EOF_SYM '!'         /**< End of Frame Symbol */
-#define HIST_SIZE 20        /**< Maximum size for the History variables */
+#define BIN_SYNC 0xA5       /**< Start of a binary frame */
+#define TAG_SYM '@'         /**< Starts the optional tag of an ASCII frame */
+#define ERR_SYM '?'         /**< CMD of the response to a failed tagged request */
+#define CMD_TAG_FLAG 0x80   /**< Set in the OP byte of a binary frame followed by a tag byte */
+#define CMD_NO_TAG -1       /**< Request sent without a tag */
+#define CMD_PUSH_TAG 0xFF   /**< Tag of the frames pushed by cmdPush(), refused in requests so a push never looks like a response */
+#define CMD_MAX_BATCH 8      /**< Maximum number of sub-commands of a batch 'X' frame */
+#define BIN_MAX_LEN (UART_RX_SIZE-7)    /**< Maximum LEN byte of a binary frame (SYNC, LEN, a 32 bit CRC and a NULL terminator must fit UART_RX_SIZE) */
+
+#define CMD_MODE_ASCII 0    /**< Only "# CMD CS !" frames are accepted */
+#define CMD_MODE_BIN 1      /**< Binary frames are accepted too */
+
+#define CMD_CHECK_SUM 0     /**< ASCII CS is the modulo 256 sum in 3 decimal digits, binary frames use CRC-16 */
+#define CMD_CHECK_CRC16 1   /**< ASCII CS is the CRC-16/CCITT-FALSE in 4 hexadecimal digits, binary frames use CRC-16 */
+#define CMD_CHECK_CRC32 2   /**< ASCII CS is the CRC-32 in 8 hexadecimal digits, binary frames use CRC-32 */
+#ifndef CMD_CHECK_DEFAULT
+#define CMD_CHECK_DEFAULT CMD_CHECK_SUM /**< Check used by a link after cmdLinkInit(), can be changed at build time */
+#endif
 
 #define SUCCESS 1           /**< Operation completed without errors */
 #define MISSING_SOF -100    /**< Missing start of frame caracter '#' */
@@ -24,20 +41,112 @@
 #define UNKNOWN_CMD -103    /**< Command not identified */
 #define UNKNOWN_LED -104    /**< LED number not identified*/
 #define INVALID_FREQ -105   /**< Provided frequency is not valid*/
+#define INVALID_LEN -106    /**< Binary frame LEN does not match the command */
+#define INVALID_ARG -107    /**< Command argument out of range */
+
+#include <stdint.h>
 
 #include "../../includes/funcs.h"
 
+#define CMD_SUB_BUT 0        /**< Subscription to the buttons, pushed as a 'b' response */
+#define CMD_SUB_AN 1         /**< Subscription to the analog input, pushed as an 'a' response */
+#define CMD_SUB_N 2          /**< Number of signals that can be subscribed */
+
+/**
+ * @brief Subscription of a link to one signal, set by the 'W' command
+*/
+typedef struct{
+    unsigned char on;       /**< 1 if changes of the signal are pushed */
+    unsigned char primed;   /**< 1 once value holds a pushed value, 0 forces the next push */
+    int deadband;           /**< Minimum change of the value that is pushed (0 pushes every change) */
+    uint32_t interval;      /**< Minimum time between two pushes in ms */
+    int value;              /**< Last value pushed */
+    uint32_t time;          /**< Time of the last push in ms */
+} CmdSub;
+
+#define CMD_STAT_RX_BYTES 0      /**< Bytes received */
+#define CMD_STAT_FRAMES 1        /**< Frames decoded */
+#define CMD_STAT_RX_DROP 2       /**< Decoded frames dropped because the RX queue was full */
+#define CMD_STAT_RX_OVERRUN 3    /**< Bytes lost by the UART (overrun or no free RX buffer) */
+#define CMD_STAT_TX_FULL 4       /**< Responses that had to wait for a free TX slot */
+#define CMD_STAT_ERR 5           /**< First error counter, the one of code err is CMD_STAT_ERR-err-100 (MISSING_SOF to INVALID_ARG) */
+#define CMD_STAT_N 13            /**< Number of counters */
+#define CMD_STAT_MOD 1000000000  /**< Counters are reported modulo this value (9 digits) */
+
+/**
+ * @brief State of the link a command was received on
+*/
+typedef struct{
+    unsigned char mode;     /**< CMD_MODE_ASCII or CMD_MODE_BIN, changed by the 'M' command */
+    unsigned char check;    /**< CMD_CHECK_SUM, CMD_CHECK_CRC16 or CMD_CHECK_CRC32, changed by the 'K' command */
+    CmdSub sub[CMD_SUB_N];  /**< Subscriptions indexed by CMD_SUB_BUT/CMD_SUB_AN */
+    uint32_t stat[CMD_STAT_N];  /**< Link and protocol counters indexed by CMD_STAT_*, read with the 'Q' command */
+    uint32_t baud;          /**< Baud rate requested by the 'R' command, 0 once the port applied it */
+} CmdLink;
+
+#define CMD_MAX_FIELDS 4    /**< Maximum number of arguments or results of a command */
+#define CMD_MAX_RES 16      /**< Size of the res buffer of a handler, repeated results included */
+#define CMD_HIST_MAX 4      /**< Samples returned by one 'Y' frame (older ones are read with its offset), the tagged CRC-32 ASCII response still fits UART_TX_SIZE (in a batch the room is checked) */
+#define CMD_DEC_MAX 9       /**< Widest decimal field, any value of 9 digits fits an int */
+#define CMD_BITS_MAX 32     /**< Widest bit vector field */
+#define FIELD_DEC 0         /**< Decimal number, ASCII uses width digits */
+#define FIELD_BITS 1        /**< Bit vector, ASCII uses one '0'/'1' per bit starting with bit 0 */
+
+/**
+ * @brief Argument or result of a command
+*/
+typedef struct{
+    unsigned char kind;     /**< FIELD_DEC or FIELD_BITS */
+    unsigned char width;    /**< Number of ASCII characters, the binary size is derived from it (see cmdProcess()) */
+} CmdField;
+
+#define CMD_DEC(n) {FIELD_DEC, n}   /**< Decimal field with n digits */
+#define CMD_BITS(n) {FIELD_BITS, n} /**< Field with n bits */
+
 /**
- * @brief Processes the characters in the Rx buffer looking for a command
+ * @brief Descriptor of a command
  * 
- * The structure of a command in the Rx Buffer is: "# CMD CS !" (without the spaces) <br>
+ * Declares the layout of the DATA of the command and of its response, frame structure and checksum
+ * are checked by the shared code before the validator and the handler run.
+*/
+typedef struct{
+    unsigned char op;                   /**< Opcode 'A' to 'Z', the response uses the lower case one */
+    unsigned char nArg;                 /**< Number of arguments */
+    CmdField arg[CMD_MAX_FIELDS];       /**< Arguments in frame order */
+    unsigned char nRes;                 /**< Number of results */
+    CmdField res[CMD_MAX_FIELDS];       /**< Results in frame order */
+    int argErr;                         /**< Error returned when an argument has an invalid character */
+    int (*validate)(const int *arg);    /**< Range check of the decoded arguments (SUCCESS or an error code), NULL to accept any value */
+    int (*handler)(CmdLink *link, const int *arg, int *res, RTDB *database);   /**< Runs the command and fills res, returns SUCCESS or an error code */
+    unsigned char nRep;                 /**< Number of trailing results repeated res[0] times (values follow in res), 0 when each result appears once */
+    unsigned char maxRep;               /**< Largest res[0] of a command with nRep results, bounds its response size */
+} CmdDesc;
+
+#ifdef __ZEPHYR__
+#include <errno.h>
+#include <zephyr/init.h>
+
+/**
+ * @brief Registers a command descriptor at boot, before the application threads start
+ * 
+ * Example: CMD_REGISTER(cmdS); in the module that defines "static const CmdDesc cmdS"
+*/
+#define CMD_REGISTER(desc) \
+    static int desc##_register(void){ return cmdRegister(&desc) == SUCCESS ? 0 : -EINVAL; } \
+    SYS_INIT(desc##_register, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY)
+#endif
+
+/**
+ * @brief Processes the characters in the cmd parameter looking for a command
+ * 
+ * The structure of a command in the cmd is: "# CMD CS !" (without the spaces) <br>
  * <ul>
  *      <li> # &rarr; Start of frame <br>
  *      <li> CMD &rarr; Type of command 'B'/'L'/'A'/'U', more information bellow <br>
  *      <li> CS &rarr; Modulo 256 3-bit checksum of the bytes in the CMD <br>
  *      <li> ! &rarr; End of frame <br>
  * </ul>     
- * Depending on the provided CMD a reponse command is sent to the Tx Buffer <br>
+ * Depending on the provided CMD a reponse command is sent to the resp buffer <br>
  * Types of CMD: <br>
  * <ul>
  *       <li> 'B' &rarr; Reads the state of all Buttons (1-4). A command is sent to the Tx Buffer with structure "# CMD DATA CS !" where: <br>
@@ -45,26 +154,141 @@
  *          <li> CMD &rarr; in this case will be the byte 'b' <br>
  *          <li> DATA &rarr; containts 4 bytes of type '1' (pressed) or '0' (not pressed) for each button 1 to 4 <br>
  *          <li> CS &rarr; checksum of CMD and DATA bytes <br>
+ *          <li> Example: #b0010[CS]! means Button 1/2/4 are not pressed and Button 3 is pressed
  *       </ul>
- *       <li> 'L','[1/2/3/4]' &rarr; Toggles the state of the provided LED number. A command is sent to the Tx Buffer with structure "# CMD CS !" where: <br>
+ *       <li> 'L','[1/2/3/4]' &rarr; Toggles the state of the provided LED number. A command is sent to the Tx Buffer with structure "# CMD DATA CS !" where: <br>
  *       <ul>
  *          <li> CMD &rarr; 'l' <br>
+ *          <li> DATA &rarr; two bytes, first the LED id and second what state it was toggled to
+ *          <li> Example: #l11[CS]! means LED 1 was toggled to state 1 (ON)
  *       </ul>
  *       <li> 'A' &rarr; Reads the analog sensor. A command is sent to the Tx Buffer with structure "# CMD DATA CS !" where: <br>
  *       <ul>
  *          <li> CMD &rarr; 'a' <br>
- *          <li> DATA &rarr; 3 bytes corresponding to the value read <br>
+ *          <li> DATA &rarr; 4 bytes corresponding to the value read <br>
+ *          <li> Example: #a1021[CS]! means the analog read has 1021 to convert it just raw*3/(2^10)
  *       </ul>
- *       <li> 'U','[x/x]' &rarr; Change frequecy of update of the in/out digital signals of RTDB to xx MHz. A command is sent to the Tx Buffer with structure "# CMD CS !" where: <br>
+ *       <li> 'U','[x/x]' &rarr; Change period of update of the in/out digital signals of RTDB to xx in sec (01 to 99, 00 is rejected with INVALID_FREQ). A command is sent to the Tx Buffer with structure "# CMD CS !" where: <br>
  *       <ul>
  *          <li> CMD &rarr; 'u' <br>
  *          <li> DATA &rarr; 'xx' (same as the provided one) <br>
+ *          <li> Example: #u02[CS]! means the period was changed to 2 secs
+ *       </ul>
+ *       <li> 'S','[xxxx]' &rarr; Change the sampling frequency of the analog input in continuous mode to xxxx Hz (1 to AN_FREQ_MAX). A command is sent to the Tx Buffer with structure "# CMD DATA CS !" where: <br>
+ *       <ul>
+ *          <li> CMD &rarr; 's' <br>
+ *          <li> DATA &rarr; 'xxxx' (same as the provided one) <br>
+ *          <li> Example: #s1000[CS]! means the analog input is sampled at 1 kHz in continuous mode
+ *       </ul>
+ *       <li> 'P' &rarr; Toggles the analog reading mode between single-shot (one read per RTDB refresh) and continuous (timer driven sampling at the 'S' frequency). A command is sent to the Tx Buffer with structure "# CMD DATA CS !" where: <br>
+ *       <ul>
+ *          <li> CMD &rarr; 'p' <br>
+ *          <li> DATA &rarr; the new mode, 0 (AN_MODE_SINGLE) or 1 (AN_MODE_CONT) <br>
+ *          <li> Example: #p1[CS]! means the continuous sampling is running
+ *       </ul>
+ *       <li> 'M','[0/1]' &rarr; Switches the link to ASCII only (0) or binary (1) mode, see cmdProcess(). A command is sent to the Tx Buffer with structure "# CMD DATA CS !" where: <br>
+ *       <ul>
+ *          <li> CMD &rarr; 'm' <br>
+ *          <li> DATA &rarr; the new mode <br>
+ *          <li> Example: #m1[CS]! means binary frames are now accepted
+ *       </ul>
+ *       <li> 'X',[CMD DATA]... &rarr; Batch, runs up to CMD_MAX_BATCH sub-commands (CMD and DATA as above, without SOF, CS and EOF) in order. A command is sent to the Tx Buffer with structure "# CMD DATA CS !" where: <br>
+ *       <ul>
+ *          <li> CMD &rarr; 'x' <br>
+ *          <li> DATA &rarr; for each sub-command its response CMD, a STATUS digit (0 on success or the error code without the -100 offset, e.g. 4 for UNKNOWN_LED) and its response DATA when STATUS is 0. An unknown sub-command ends the batch <br>
+ *          <li> A sub-command whose largest response would not fit UART_TX_SIZE ends the batch with STATUS 6 (INVALID_LEN) and is not run <br>
+ *          <li> Example: #XBAL1[CS]! answered with #xb01001a01021l011[CS]!
  *       </ul>
  *  </ul>
- * @return EMPTY_BUFFER if Rx Buffer is empty, MISSING_EOF if '!' is not found, WRONG_CS if checksum is wrong, MISSING_SENSOR_TYPE sensor type is not found (for 'P' CMD), MISSING_SOF if a '#' is not found and UNKNOWN_CMD if the CMD is not identified
+ * @param[in] cmd pointer to the buffer contaning the command
+ * @param[in] resp pointer to the buffer to store the response command
+ * @param[in] database Real Time Database to get the values from
+ * @return SUCCESS, MISSING_EOF if '!' is not found, WRONG_CS if checksum is wrong, UNKNOWN_LED/INVALID_FREQ/INVALID_ARG if the DATA is not valid, MISSING_SOF if a '#' is not found and UNKNOWN_CMD if the CMD is not identified
  */
 int cmdProcessor(char *cmd, char *resp, RTDB *database);
 
+/**
+ * @brief Adds a command to the O(1) opcode table
+ * 
+ * @param[in] desc descriptor of the command, must stay valid while the program runs
+ * @return SUCCESS, INVALID_ARG if the opcode is not 'A' to 'Z', is already used or the descriptor is not valid, INVALID_LEN if the
+ * tagged CRC-32 request does not fit UART_RX_SIZE or the largest tagged CRC-32 response does not fit UART_TX_SIZE
+*/
+int cmdRegister(const CmdDesc *desc);
+
+/**
+ * @brief Initializes a link in ASCII mode with the CMD_CHECK_DEFAULT check
+ * 
+ * @param[in] link pointer to the link
+ * @return void
+*/
+void cmdLinkInit(CmdLink *link);
+
+/**
+ * @brief Processes an ASCII or a binary frame received on a link
+ * 
+ * ASCII frames are handled as in cmdProcessor(). A binary frame has the structure "SYNC LEN OP PAYLOAD CRC" <br>
+ * <ul>
+ *      <li> SYNC &rarr; BIN_SYNC byte <br>
+ *      <li> LEN &rarr; number of bytes of OP and PAYLOAD (1 to BIN_MAX_LEN) <br>
+ *      <li> OP &rarr; same opcode as the ASCII CMD ('B'/'L'/'A'/'U'/'M') <br>
+ *      <li> PAYLOAD &rarr; packed arguments, each decimal field uses 1 byte up to 2 digits, 2 bytes up to 4 digits and 4 bytes above (big endian),
+ *           bit fields are packed LSB first (e.g. the 'b' response is a single byte with button 1 in bit 0) <br>
+ *      <li> CRC &rarr; CRC-16/CCITT-FALSE (or CRC-32 when the link uses CMD_CHECK_CRC32) of LEN, OP and PAYLOAD, big endian <br>
+ * </ul>
+ * The response uses the framing of the request with the lower case opcode. <br>
+ * Any request may carry a tag that is echoed in its response, so several requests can be in flight and matched by the host: <br>
+ * <ul>
+ *      <li> ASCII &rarr; "# @ TT CMD DATA CS !" where TT is the tag in two hexadecimal digits, covered by CS. Example: #@1FB[CS]! answered with #@1Fb1001[CS]! <br>
+ *      <li> Binary &rarr; OP with CMD_TAG_FLAG set followed by the tag byte, counted in LEN. Example: SYNC 2 0xC2 0x1F CRC answered with SYNC 3 0xE2 0x1F 0x09 CRC <br>
+ * </ul>
+ * A tagged request that fails after its tag was decoded is answered with ERR_SYM and a STATUS digit (the error code without the -100 offset),
+ * e.g. #@1E?2[CS]! for a WRONG_CS or SYNC 3 0xBF 0x1F 0x03 CRC for an UNKNOWN_CMD, untagged requests that fail produce no response.
+ * The tag CMD_PUSH_TAG is reserved for pushes, a request carrying it fails with INVALID_ARG and no response. <br>
+ * 'Q','[ii]' reads the counters ii, ii+1 and ii+2 (CMD_STAT_*, 0 after the last one) of the link modulo CMD_STAT_MOD.
+ * Example: #Q00[CS]! answered with #q00000001234000000056000000000[CS]! (1234 bytes received, 56 frames decoded, none dropped) <br>
+ * 'T' reads the delay in us of the start of the last RTDB refresh after its deadline and the largest one since the previous 'T'.
+ * Example: #T[CS]! answered with #t000012000250[CS]! <br>
+ * 'R','[bbbbbbb]' switches the UART to bbbbbbb baud (9600 to 1000000) after the response is sent at the current rate, the old rate is restored
+ * if no valid frame is received at the new one within BAUD_TIMEOUT_MS. Example: #R0921600[CS]! answered with #r0921600[CS]! <br>
+ * 'W','[0/1]','[0/1]','[dddd]','[iiii]' subscribes (1) or unsubscribes (0) the link to the buttons (CMD_SUB_BUT) or the analog input (CMD_SUB_AN).
+ * Changes are then pushed by cmdPush() as 'b'/'a' frames tagged CMD_PUSH_TAG (#@FFb1001[CS]!), so they never shift the untagged responses,
+ * the analog input only when it moves more than dddd from the last pushed value, and at most one push every iiii ms. The current value is pushed right after subscribing. Example: #W1100100500[CS]! answered with #w11[CS]! <br>
+ * 'Y','[nn]','[oo]' reads nn (1 to CMD_HIST_MAX) analog samples of the RTDB history, oldest first, ending oo samples before the newest
+ * (nn + oo below HIST_SIZE), so the whole history is read in pages. The response holds the number of samples (fewer right after boot), the
+ * uptime of the first one in ms (9 digits) and for each sample the ms since the previous one (5 digits, 0 for the first) and its value.
+ * Example: #Y0200[CS]! answered with #y02000012000000001021010001019[CS]!, then #Y0202[CS]! for the two samples before them <br>
+ * 'I','[ii]','[0/1]','[vvvv]' reads (0) or writes (1) the RTDB signal with ID ii (SIG_BUT1 to SIG_AN1, see RTDB_SIGNALS) and answers with its
+ * current value, only digital outputs can be written (vvvv 0 or 1). Example: #I0410001[CS]! answered with #i040001[CS]! (LED 1 on) <br>
+ * 'D','[vvvvvvvvv]' reads the RTDB groups changed after generation vvvvvvvvv. The response holds the number of groups, the current generation
+ * (the vvvvvvvvv of the next poll) and for each group its RTDB_GRP_* number and value (button or LED bits, bit 0 for number 1, or anRaw).
+ * Example: #D000000007[CS]! answered with #d20000000090000921021[CS]! (buttons 1 and 4 pressed, analog at 1021) or #d0000000009[CS]! when idle <br>
+ * 'M','[0/1]' switches the link to CMD_MODE_ASCII or CMD_MODE_BIN, ASCII frames are always accepted. Example: #M1[CS]! answered with #m1[CS]! <br>
+ * 'K','[0/1/2]' selects the integrity check of the link (CMD_CHECK_SUM, CMD_CHECK_CRC16 or CMD_CHECK_CRC32). ASCII CS fields then hold the
+ * CRC of CMD and DATA in upper case hexadecimal. The response is still checked with the previous one. Example: #K1[CS]! answered with #k1[CS]!, then #B[CRC16]!
+ * @param[in] link link the frame was received on
+ * @param[in] frame pointer to the received frame
+ * @param[in] len number of bytes in frame
+ * @param[out] resp buffer to store the response frame (NULL terminated when ASCII)
+ * @param[in] database Real Time Database to get the values from
+ * @return number of bytes written to resp (the error frame of a failed tagged request) or one of the error codes
+*/
+int cmdProcess(CmdLink *link, const uint8_t *frame, int len, uint8_t *resp, RTDB *database);
+
+/**
+ * @brief Builds the next push frame of the subscriptions of a link
+ *
+ * Called after every RTDB refresh until it returns 0, each call returns at most one frame in the framing of the link mode,
+ * tagged CMD_PUSH_TAG so the host tells it from a response.
+ * With a NULL resp nothing is built and the subscriptions are left as they are, so a TX slot is only taken when there is a frame to send.
+ * @param[in] link link whose subscriptions are checked
+ * @param[in] database Real Time Database to get the values from
+ * @param[in] now current time in ms
+ * @param[out] resp buffer with at least UART_TX_SIZE bytes to store the frame, or NULL
+ * @return number of bytes written to resp (1 with a NULL resp), 0 if nothing has to be pushed
+*/
+int cmdPush(CmdLink *link, RTDB *database, uint32_t now, uint8_t *resp);
+
 /**
  * @brief Computes the modulo 256 checksum of a given number of bytes
  * 
@@ -0,0 +1,70 @@
+/** @file main.c
+ * @brief Tests of the persistent configuration on native_sim (west build -b native_sim tests/store -t run)
+ *
+ * @author Gonçalo Peralta & João Alvares
+ * @date 17 October 2026
+ * @bug No known bugs.
+*/
+#include <zephyr/ztest.h>
+#include <zephyr/settings/settings.h>
+
+#include "../../../includes/store.h"
+#include "../../../includes/funcs.h"
+
+static const StoreCfg defaults = {5000, AN_FREQ_DEFAULT, AN_MODE_SINGLE, 0};
+
+// Every test starts without a stored configuration, the flash simulator may keep it between runs
+static void before(void *fixture){
+	zassert_ok(settings_subsys_init());
+	settings_delete(STORE_KEY);
+}
+
+ZTEST(store, test_save_reload){
+	StoreCfg cfg = defaults;
+	StoreCfg set = {2000000, 250, AN_MODE_CONT, 0x5};
+	int writes;
+
+	zassert_ok(storeInit(&cfg));
+	zassert_mem_equal(&cfg, &defaults, sizeof(cfg), "Nothing stored, the defaults are kept");
+	writes = storeWrites();
+
+	// A burst of changes within STORE_DELAY_MS shares one write with the latest values
+	for(int i = 0; i < 10; i++){
+		StoreCfg tmp = set;
+
+		tmp.leds = i & 0xF;
+		storeSave(&tmp);
+		k_msleep(10);
+	}
+	storeSave(&set);
+	k_msleep(STORE_DELAY_MS + 100);
+	zassert_equal(storeWrites(), writes + 1, "The burst was not coalesced");
+
+	// Reload as after a reset
+	cfg = defaults;
+	zassert_ok(storeInit(&cfg));
+	zassert_mem_equal(&cfg, &set, sizeof(cfg), "Stored configuration not restored");
+
+	// Same values as in flash, nothing is written
+	storeSave(&set);
+	k_msleep(STORE_DELAY_MS + 100);
+	zassert_equal(storeWrites(), writes + 1);
+}
+
+ZTEST(store, test_changed_back){
+	StoreCfg cfg = defaults;
+	StoreCfg tmp = defaults;
+	int writes;
+
+	zassert_ok(storeInit(&cfg));
+	writes = storeWrites();
+
+	// Changed and restored before the deadline, flash already holds these values
+	tmp.leds = 0xF;
+	storeSave(&tmp);
+	storeSave(&defaults);
+	k_msleep(STORE_DELAY_MS + 100);
+	zassert_equal(storeWrites(), writes);
+}
+
+ZTEST_SUITE(store, NULL, NULL, before, NULL, NULL);
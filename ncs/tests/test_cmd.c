@@ -1,6 +1,9 @@
 #include "../unity/unity.h"
 #include "../unity/unity_internals.h"
 #include "./no_nfr/cmdproc.h"
+#include "../includes/frame.h"
+#include "../includes/crc.h"
+#include "../includes/store.h"
 #include <string.h>
 
 void setUp(){}
@@ -10,10 +13,7 @@ RTDB database;
 
 void test_cmdProcessor_Bcmd(){ // Tests for the B command
     char buf[20], resp[20];
-    database.but[0] = 1;
-    database.but[1] = 0;
-    database.but[2] = 0;
-    database.but[3] = 1;
+    atomic_set(&database.io, 0x9 << RTDB_BUT_SHIFT);    // Buttons 1 and 4 pressed
 
     strcpy(buf, "#B066!"); // expected return #b1001036!
     TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
@@ -22,14 +22,14 @@ void test_cmdProcessor_Bcmd(){ // Tests for the B command
 
 void test_cmdProcessor_Lcmd(){ // Test for L cmd
     char buf[20], resp[20];
-    database.led[0] = 0;
+    atomic_and(&database.io, ~RTDB_LED_MASK);
 
     // Command to toggle LED 1
     strcpy(buf, "#L1125!"); // expected return #l11206!
 
     TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
     TEST_ASSERT_EQUAL_STRING_LEN("#l11206!", resp, 9);
-    TEST_ASSERT_EQUAL_INT(1, database.led[0]); // Check if LED 1 is on
+    TEST_ASSERT_EQUAL_INT(1, (atomic_get(&database.io) >> 0) & 1); // Check if LED 1 is on
 }
 
 void test_cmdProcessor_Acmd(){ // Test for A cmd
@@ -49,6 +49,155 @@ void test_cmdProcessor_Ucmd(){ // Test for R cmd
 
     TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
     TEST_ASSERT_EQUAL_STRING_LEN("#u02215!", resp, 9);
+
+    strcpy(buf, "#U00181!");        // A zero period is rejected
+    TEST_ASSERT_EQUAL_INT(INVALID_FREQ, cmdProcessor(buf, resp, &database));
+}
+
+void test_cmdProcessor_Scmd(){ // Test for S cmd
+    char buf[20], resp[20];
+    database.anFreq = 100;
+
+    strcpy(buf, "#S1000020!");
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#s1000052!", resp);
+    TEST_ASSERT_EQUAL_INT(1000, database.anFreq);
+
+    strcpy(buf, "#S0000019!");      // 0 Hz is not a valid frequency
+    TEST_ASSERT_EQUAL_INT(INVALID_FREQ, cmdProcessor(buf, resp, &database));
+    TEST_ASSERT_EQUAL_INT(1000, database.anFreq);
+}
+
+void test_cmdProcessor_Rcmd(){ // Test for R cmd
+    char buf[20], resp[20];
+
+    strcpy(buf, "#R0921600180!");
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#r0921600212!", resp);
+
+    strcpy(buf, "#R0921601181!");   // Not a supported baud rate
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcessor(buf, resp, &database));
+}
+
+void test_cmdProcessor_Tcmd(){ // Test for T cmd
+    char buf[20], resp[20];
+    database.jitLast = 12;
+    database.jitMax = 250;
+
+    strcpy(buf, "#T084!");
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#t000012000250190!", resp);
+    TEST_ASSERT_EQUAL_INT(0, database.jitMax);
+
+    database.jitMax = 2000000;      // Saturated to 6 digits
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#t000012999999237!", resp);
+}
+
+void test_cmdProcessor_Ycmd(){ // Test for Y cmd
+    char resp[40];
+    database.hist.head = 0;
+
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#Y0100026!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#y00000000000137!", resp);    // Nothing pushed yet
+
+    rtdbHistPush(&database, 12000, 1000);
+    rtdbHistPush(&database, 13000, 1021);
+    rtdbHistPush(&database, 14000, 1019);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#Y0200027!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#y02000013000000001021010001019255!", resp);
+
+    for(int i = 0; i < 25; i++){    // Wraps the ring
+        rtdbHistPush(&database, 10000 + i*1000, 1000 + i);
+    }
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#Y0100026!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#y01000034000000001024072!", resp);
+
+    // Older samples are read in pages
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#Y0105031!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#y01000029000000001019080!", resp);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#Y0217035!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#y02000016000000001006010001007002!", resp);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#Y0118035!", resp, &database));     // Oldest readable sample
+    TEST_ASSERT_EQUAL_STRING("#y01000016000000001006072!", resp);
+
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcessor("#Y0500030!", resp, &database));
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcessor("#Y0000025!", resp, &database));
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcessor("#Y0119036!", resp, &database));  // Beyond the readable history
+}
+
+void test_cmdProcessor_Icmd(){ // Test for I cmd
+    char resp[20];
+    atomic_set(&database.io, 0x9 << RTDB_BUT_SHIFT);    // Buttons 1 and 4 pressed, LEDs off
+    database.anRaw = 1021;
+
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#I0000000153!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#i000001138!", resp);        // Button 1
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#I0800000161!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#i081021149!", resp);        // Analog input
+
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#I0410001159!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#i040001142!", resp);        // LED 1 on
+    TEST_ASSERT_EQUAL_INT(1, atomic_get(&database.io) & 1);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#I0410001159!", resp, &database));
+    TEST_ASSERT_EQUAL_INT(1, atomic_get(&database.io) & 1);   // Written, not toggled
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#I0410000158!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#i040000141!", resp);
+    TEST_ASSERT_EQUAL_INT(0x9 << RTDB_BUT_SHIFT, atomic_get(&database.io));
+
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcessor("#I0010001155!", resp, &database));  // Inputs are read only
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcessor("#I0900000162!", resp, &database));  // No signal 9
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcessor("#I0420000159!", resp, &database));
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcessor("#I0410002160!", resp, &database));
+}
+
+void test_cmdProcessor_Dcmd(){ // Test for D cmd
+    char resp[40];
+    atomic_set(&database.io, 0x9 << RTDB_BUT_SHIFT);    // Buttons 1 and 4 pressed, LEDs off
+    database.anRaw = 1021;
+    database.gen = 1;
+    for(int i = 0; i < RTDB_GRP_N; i++){
+        database.ver[i] = 1;
+    }
+
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#D000000000244!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#d3000000001000091000021021040!", resp);    // First poll gets every group
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#D000000001245!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#d0000000001069!", resp);    // Idle
+
+    atomic_or(&database.io, 1);
+    rtdbTouch(&database, RTDB_GRP_LED);
+    rtdbTouch(&database, RTDB_GRP_AN);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#D000000001245!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#d20000000031000121021049!", resp);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#D000000002246!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#d100000000321021062!", resp);    // Only the analog input changed after generation 2
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#D000000099006!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#d3000000003000091000121021043!", resp);    // Ahead of the generation (wrapped), every group
+
+    database.gen = RTDB_GEN_MOD - 1;     // Buttons and analog input idle since just before the wrap
+    database.ver[RTDB_GRP_BUT] = RTDB_GEN_MOD - 2;
+    database.ver[RTDB_GRP_AN] = RTDB_GEN_MOD - 2;
+    rtdbTouch(&database, RTDB_GRP_LED);
+    TEST_ASSERT_EQUAL_INT(1, database.gen);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#D000000001245!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#d0000000001069!", resp);    // Idle groups are not reported again
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#D999999999069!", resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#d3000000001000091000121021041!", resp);    // Polled before the wrap, every group once
+}
+
+void test_cmdProcessor_Pcmd(){ // Test for P cmd
+    char buf[20], resp[20];
+    database.anMode = AN_MODE_SINGLE;
+
+    strcpy(buf, "#P080!");
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#p1161!", resp);
+    TEST_ASSERT_EQUAL_INT(AN_MODE_CONT, database.anMode);
+
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#p0160!", resp);
+    TEST_ASSERT_EQUAL_INT(AN_MODE_SINGLE, database.anMode);
 }
 
 void test_cmdProcessor_Checksum(){ // Sending commands with wrong checksum
@@ -67,6 +216,16 @@ void test_cmdProcessor_Checksum(){ // Sending commands with wrong checksum
 	TEST_ASSERT_EQUAL_INT(WRONG_CS, cmdProcessor(buf, resp, &database));
 }
 
+void test_cmdProcessor_ChecksumDigits(){ // Checksum field must hold exactly 3 decimal digits
+    char buf[20], resp[20];
+
+    strcpy(buf, "#B 66!");      // " 66" would be accepted by atoi()
+    TEST_ASSERT_EQUAL_INT(WRONG_CS, cmdProcessor(buf, resp, &database));
+
+    strcpy(buf, "#A06a!");
+    TEST_ASSERT_EQUAL_INT(WRONG_CS, cmdProcessor(buf, resp, &database));
+}
+
 void test_cmdProcessor_UnknownCommand(){ // Sending an different unknown command to the system
     char buf[20], resp[20];
 
@@ -81,6 +240,442 @@ void test_cmdProcessor_MissingSOF(){ // Sending a command without the Start of F
     TEST_ASSERT_EQUAL_INT(MISSING_SOF, cmdProcessor(buf, resp, &database));
 }
 
+void test_cmdProcessor_Batch(){ // Several commands in one frame
+    char buf[64], resp[64];
+    atomic_set(&database.io, 0x9 << RTDB_BUT_SHIFT);    // Buttons 1 and 4 pressed
+    database.anRaw = 1021;
+    atomic_and(&database.io, ~RTDB_LED_MASK);
+
+    strcpy(buf, "#XBAL1088!");
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#xb01001a01021l011031!", resp);
+    TEST_ASSERT_EQUAL_INT(1, (atomic_get(&database.io) >> 0) & 1);
+
+    // Invalid LED is reported and the batch goes on, an unknown command ends it
+    strcpy(buf, "#XL5AH098!");
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#xl4a01021h3008!", resp);
+
+    strcpy(buf, "#XBBBBBBBBB170!");     // More than CMD_MAX_BATCH sub-commands
+    TEST_ASSERT_EQUAL_INT(INVALID_LEN, cmdProcessor(buf, resp, &database));
+
+    strcpy(buf, "#XBAL1089!");
+    TEST_ASSERT_EQUAL_INT(WRONG_CS, cmdProcessor(buf, resp, &database));
+}
+
+void test_cmdProcessor_BatchRoom(){ // Responses never leave the UART_TX_SIZE slot
+    char resp[UART_TX_SIZE + 16];
+    const char *big[] = {"#XQ00Q00Q00Q00Q00Q00Q00Q00224!", "#XY0400Y0400Y0400Y0400Y0400Y0400Y0400Y0400064!"};
+    const char *last[] = {"q6", "y6"};  // Sub-command that did not fit, INVALID_LEN
+
+    for(int i = 0; i < 2; i++){
+        memset(resp, 0x55, sizeof(resp));
+        TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor((char *)big[i], resp, &database));
+        TEST_ASSERT_LESS_THAN_INT(UART_TX_SIZE, strlen(resp));
+        TEST_ASSERT_EQUAL_HEX8(0x55, resp[UART_TX_SIZE]);  // Nothing written after the slot
+        TEST_ASSERT_EQUAL_STRING_LEN(last[i], &resp[strlen(resp) - 6], 2);
+    }
+}
+
+static int cmdEchoTwice(CmdLink *link, const int *arg, int *res, RTDB *database){
+    res[0] = arg[0]*10;
+    return SUCCESS;
+}
+
+void test_cmdRegister(){ // Commands added by the application
+    static const CmdDesc cmdZ = {'Z', 1, {CMD_DEC(2)}, 1, {CMD_DEC(3)}, INVALID_ARG, NULL, cmdEchoTwice};
+    static const CmdDesc cmdDup = {'B', 0, {}, 0, {}, 0, NULL, cmdEchoTwice};
+    static const CmdDesc cmdLower = {'z', 0, {}, 0, {}, 0, NULL, cmdEchoTwice};
+    static const CmdDesc cmdBig = {'V', 0, {}, 2, {CMD_DEC(2), CMD_DEC(9)}, 0, NULL, cmdEchoTwice, 1, 15};   // 137 characters
+    static const CmdDesc cmdWide = {'V', 1, {CMD_DEC(10)}, 0, {}, 0, NULL, cmdEchoTwice};
+    static const CmdDesc cmdLongArg = {'V', 4, {CMD_BITS(32), CMD_BITS(32), CMD_BITS(32), CMD_BITS(32)}, 0, {}, 0, NULL, cmdEchoTwice};
+    char buf[20], resp[20];
+
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdRegister(&cmdZ));
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdRegister(&cmdZ));
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdRegister(&cmdDup));
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdRegister(&cmdLower));
+
+    // Descriptors whose frames would not fit the RX frame or the TX slot are refused
+    TEST_ASSERT_EQUAL_INT(INVALID_LEN, cmdRegister(&cmdBig));
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdRegister(&cmdWide));
+    TEST_ASSERT_EQUAL_INT(INVALID_LEN, cmdRegister(&cmdLongArg));
+    strcpy(buf, "#V086!");
+    TEST_ASSERT_EQUAL_INT(UNKNOWN_CMD, cmdProcessor(buf, resp, &database));
+
+    strcpy(buf, "#Z42192!");
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor(buf, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#z420016!", resp);
+
+    strcpy(buf, "#Z4x192!");
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcessor(buf, resp, &database));
+}
+
+void test_frameFeed_Split(){ // Frame received across several UART events
+    CmdLink link;
+    FrameDecoder dec;
+    FrameQueue q;
+    char cmd[FRAME_MAX_LEN];
+
+    cmdLinkInit(&link);
+    frameDecoderInit(&dec, &link);
+    frameQueueInit(&q);
+
+    TEST_ASSERT_EQUAL_INT(0, frameFeed(&dec, &q, (const uint8_t *)"#L1", 3));
+    TEST_ASSERT_EQUAL_INT(0, frameQueuePop(&q, cmd));
+    TEST_ASSERT_EQUAL_INT(1, frameFeed(&dec, &q, (const uint8_t *)"125!#B0", 7));
+    TEST_ASSERT_EQUAL_INT(1, frameFeed(&dec, &q, (const uint8_t *)"66!", 3));
+
+    TEST_ASSERT_EQUAL_INT(7, frameQueuePop(&q, cmd));
+    TEST_ASSERT_EQUAL_STRING("#L1125!", cmd);
+    TEST_ASSERT_EQUAL_INT(6, frameQueuePop(&q, cmd));
+    TEST_ASSERT_EQUAL_STRING("#B066!", cmd);
+    TEST_ASSERT_EQUAL_INT(0, frameQueuePop(&q, cmd));
+}
+
+void test_frameFeed_Resync(){ // Garbage, truncated and overlong frames are discarded
+    CmdLink link;
+    FrameDecoder dec;
+    FrameQueue q;
+    char cmd[FRAME_MAX_LEN];
+    char rx[2*FRAME_MAX_LEN] = "xx!#B0#A065!#B";
+
+    memset(&rx[14], '0', FRAME_MAX_LEN);     // Overlong frame
+    strcpy(&rx[14+FRAME_MAX_LEN], "!#B066!");
+    cmdLinkInit(&link);
+    frameDecoderInit(&dec, &link);
+    frameQueueInit(&q);
+
+    TEST_ASSERT_EQUAL_INT(2, frameFeed(&dec, &q, (const uint8_t *)rx, strlen(rx)));
+    TEST_ASSERT_EQUAL_INT(6, frameQueuePop(&q, cmd));
+    TEST_ASSERT_EQUAL_STRING("#A065!", cmd);
+    TEST_ASSERT_EQUAL_INT(6, frameQueuePop(&q, cmd));
+    TEST_ASSERT_EQUAL_STRING("#B066!", cmd);
+}
+
+void test_frameFeed_QueueFull(){ // Frames are dropped, never overwritten, when the queue is full
+    CmdLink link;
+    FrameDecoder dec;
+    FrameQueue q;
+    char cmd[FRAME_MAX_LEN];
+
+    cmdLinkInit(&link);
+    frameDecoderInit(&dec, &link);
+    frameQueueInit(&q);
+
+    for(int i = 0; i < FRAME_QUEUE_LEN; i++){
+        frameFeed(&dec, &q, (const uint8_t *)"#A065!", 6);
+    }
+    TEST_ASSERT_EQUAL_INT(0, frameFeed(&dec, &q, (const uint8_t *)"#B066!", 6));
+    TEST_ASSERT_EQUAL_INT(1, q.dropped);
+    TEST_ASSERT_EQUAL_INT(6, frameQueuePop(&q, cmd));
+    TEST_ASSERT_EQUAL_STRING("#A065!", cmd);
+}
+
+void test_frameQueue_Peek(){ // Frames used in place stay queued until they are released
+    FrameQueue q;
+    const char *frame;
+    int len = 0;
+
+    frameQueueInit(&q);
+    TEST_ASSERT_NULL(frameQueuePeek(&q, &len));
+    TEST_ASSERT_EQUAL_INT(1, frameQueuePush(&q, "#b1001036!", 10));
+    TEST_ASSERT_EQUAL_INT(1, frameQueuePush(&q, "#a1021037!", 10));
+
+    frame = frameQueuePeek(&q, &len);
+    TEST_ASSERT_EQUAL_INT(10, len);
+    TEST_ASSERT_EQUAL_STRING("#b1001036!", frame);
+    TEST_ASSERT_EQUAL_PTR(frame, frameQueuePeek(&q, &len));
+    frameQueueRelease(&q);
+    TEST_ASSERT_EQUAL_STRING("#a1021037!", frameQueuePeek(&q, &len));
+    frameQueueRelease(&q);
+    TEST_ASSERT_NULL(frameQueuePeek(&q, &len));
+}
+
+void test_frameQueue_Reserve(){ // Frames written in place are only seen once committed
+    FrameQueue q;
+    char *buf;
+    int len = 0;
+
+    frameQueueInit(&q);
+    buf = frameQueueReserve(&q);
+    TEST_ASSERT_NOT_NULL(buf);
+    strcpy(buf, "#a1021037!");
+    TEST_ASSERT_NULL(frameQueuePeek(&q, &len));
+    frameQueueCommit(&q, 10);
+    TEST_ASSERT_EQUAL_PTR(buf, frameQueuePeek(&q, &len));
+    TEST_ASSERT_EQUAL_INT(10, len);
+
+    for(int i = 1; i < FRAME_QUEUE_LEN; i++){
+        TEST_ASSERT_NOT_NULL(frameQueueReserve(&q));
+        frameQueueCommit(&q, 0);
+    }
+    TEST_ASSERT_NULL(frameQueueReserve(&q));
+    TEST_ASSERT_EQUAL_INT(1, q.dropped);
+    TEST_ASSERT_EQUAL_INT(FRAME_QUEUE_LEN, frameQueueLevel(&q));
+    frameQueueRelease(&q);
+    TEST_ASSERT_EQUAL_INT(FRAME_QUEUE_LEN-1, frameQueueLevel(&q));
+}
+
+void test_cmdProcess_Binary(){ // Handshake to binary mode and binary B/L/A commands
+    CmdLink link;
+    uint8_t resp[20];
+    const uint8_t bCmd[] = {BIN_SYNC, 1, 'B', 0x46, 0xB8};
+    const uint8_t bResp[] = {BIN_SYNC, 2, 'b', 0x09, 0x5E, 0x9D};
+    const uint8_t lCmd[] = {BIN_SYNC, 2, 'L', 2, 0xCA, 0x1F};
+    const uint8_t lResp[] = {BIN_SYNC, 3, 'l', 2, 1, 0x87, 0x55};
+    const uint8_t aCmd[] = {BIN_SYNC, 1, 'A', 0x76, 0xDB};
+    const uint8_t aResp[] = {BIN_SYNC, 3, 'a', 0x03, 0xFD, 0xD8, 0xA6};
+    const uint8_t mCmd[] = {BIN_SYNC, 2, 'M', 0, 0xD9, 0x6C};
+    const uint8_t mResp[] = {BIN_SYNC, 2, 'm', 0, 0xDF, 0x8A};
+
+    cmdLinkInit(&link);
+    atomic_set(&database.io, 0x9 << RTDB_BUT_SHIFT);    // Buttons 1 and 4 pressed
+    atomic_and(&database.io, ~RTDB_LED_MASK);
+    database.anRaw = 1021;
+
+    TEST_ASSERT_EQUAL_INT(7, cmdProcess(&link, (const uint8_t *)"#M1126!", 7, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#m1158!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(CMD_MODE_BIN, link.mode);
+
+    TEST_ASSERT_EQUAL_INT(sizeof(bResp), cmdProcess(&link, bCmd, sizeof(bCmd), resp, &database));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(bResp, resp, sizeof(bResp));
+    TEST_ASSERT_EQUAL_INT(sizeof(lResp), cmdProcess(&link, lCmd, sizeof(lCmd), resp, &database));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(lResp, resp, sizeof(lResp));
+    TEST_ASSERT_EQUAL_INT(1, (atomic_get(&database.io) >> 1) & 1);
+    TEST_ASSERT_EQUAL_INT(sizeof(aResp), cmdProcess(&link, aCmd, sizeof(aCmd), resp, &database));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(aResp, resp, sizeof(aResp));
+
+    // ASCII keeps working in binary mode
+    TEST_ASSERT_EQUAL_INT(10, cmdProcess(&link, (const uint8_t *)"#B066!", 6, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#b1001036!", (char *)resp);
+
+    TEST_ASSERT_EQUAL_INT(sizeof(mResp), cmdProcess(&link, mCmd, sizeof(mCmd), resp, &database));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(mResp, resp, sizeof(mResp));
+    TEST_ASSERT_EQUAL_INT(CMD_MODE_ASCII, link.mode);
+}
+
+void test_cmdProcess_BinaryBatch(){ // Batch in a binary frame
+    CmdLink link;
+    uint8_t resp[20];
+    const uint8_t xCmd[] = {BIN_SYNC, 4, 'X', 'B', 'L', 3, 0x63, 0xFD};
+    const uint8_t xResp[] = {BIN_SYNC, 8, 'x', 'b', 0, 0x09, 'l', 0, 3, 1, 0xB7, 0x4C};
+
+    cmdLinkInit(&link);
+    atomic_set(&database.io, 0x9 << RTDB_BUT_SHIFT);    // Buttons 1 and 4 pressed
+    atomic_and(&database.io, ~RTDB_LED_MASK);
+
+    TEST_ASSERT_EQUAL_INT(sizeof(xResp), cmdProcess(&link, xCmd, sizeof(xCmd), resp, &database));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(xResp, resp, sizeof(xResp));
+}
+
+void test_cmdProcess_BinaryErrors(){ // Corrupted binary frames
+    CmdLink link;
+    uint8_t resp[20];
+    const uint8_t badCrc[] = {BIN_SYNC, 1, 'B', 0x46, 0xB9};
+    const uint8_t badLen[] = {BIN_SYNC, 2, 'B', 0, 0xC9, 0x52};   // Valid CRC but B has no payload
+
+    cmdLinkInit(&link);
+    TEST_ASSERT_EQUAL_INT(WRONG_CS, cmdProcess(&link, badCrc, sizeof(badCrc), resp, &database));
+    TEST_ASSERT_EQUAL_INT(INVALID_LEN, cmdProcess(&link, badLen, sizeof(badLen), resp, &database));
+}
+
+void test_frameFeed_Binary(){ // Binary frames are only decoded in binary mode and may contain '#'/'!'
+    CmdLink link;
+    FrameDecoder dec;
+    FrameQueue q;
+    char cmd[FRAME_MAX_LEN];
+    const uint8_t rx[] = {BIN_SYNC, 3, 'a', '!', '#', 0x00, 0x00, '#', 'B', '0', '6', '6', '!'};
+
+    cmdLinkInit(&link);
+    frameDecoderInit(&dec, &link);
+    frameQueueInit(&q);
+
+    TEST_ASSERT_EQUAL_INT(1, frameFeed(&dec, &q, rx, sizeof(rx)));  // Only the ASCII frame in ASCII mode
+    TEST_ASSERT_EQUAL_INT(6, frameQueuePop(&q, cmd));
+
+    link.mode = CMD_MODE_BIN;
+    TEST_ASSERT_EQUAL_INT(2, frameFeed(&dec, &q, rx, sizeof(rx)));
+    TEST_ASSERT_EQUAL_INT(7, frameQueuePop(&q, cmd));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(rx, cmd, 7);
+    TEST_ASSERT_EQUAL_INT(6, frameQueuePop(&q, cmd));
+}
+
+void test_crc(){ // Check values of the CRC kernels
+    const uint8_t check[] = "123456789";
+
+    TEST_ASSERT_EQUAL_HEX16(0x29B1, calcCrc16(check, 9));
+    TEST_ASSERT_EQUAL_HEX32(0xCBF43926, calcCrc32(check, 9));
+    TEST_ASSERT_EQUAL_HEX16(0xFFFF, calcCrc16(check, 0));       // Empty buffer, initial value
+    TEST_ASSERT_EQUAL_HEX32(0x00000000, calcCrc32(check, 0));
+}
+
+void test_cmdProcess_Check(){ // Check negotiation with the K command
+    CmdLink link;
+    uint8_t resp[20];
+    const uint8_t bCmd[] = {BIN_SYNC, 1, 'B', 0xC0, 0x10, 0x03, 0x02};
+    const uint8_t bResp[] = {BIN_SYNC, 2, 'b', 0x09, 0xD2, 0xD2, 0xBC, 0xFD};
+
+    cmdLinkInit(&link);
+    atomic_set(&database.io, 0x9 << RTDB_BUT_SHIFT);    // Buttons 1 and 4 pressed
+
+    // The response to K still uses the previous check
+    TEST_ASSERT_EQUAL_INT(7, cmdProcess(&link, (const uint8_t *)"#K1124!", 7, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#k1156!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(CMD_CHECK_CRC16, link.check);
+    TEST_ASSERT_EQUAL_INT(11, cmdProcess(&link, (const uint8_t *)"#B8976!", 7, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#b1001F04C!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(MISSING_EOF, cmdProcess(&link, (const uint8_t *)"#B066!", 6, resp, &database));
+
+    TEST_ASSERT_EQUAL_INT(8, cmdProcess(&link, (const uint8_t *)"#K2DA28!", 8, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#k2DCCE!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(15, cmdProcess(&link, (const uint8_t *)"#B4ad0cf31!", 11, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#b1001C7B49FAD!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(WRONG_CS, cmdProcess(&link, (const uint8_t *)"#B4AD0CF32!", 11, resp, &database));
+
+    // Binary frames follow the link check too
+    link.mode = CMD_MODE_BIN;
+    TEST_ASSERT_EQUAL_INT(sizeof(bResp), cmdProcess(&link, bCmd, sizeof(bCmd), resp, &database));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(bResp, resp, sizeof(bResp));
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcess(&link, (const uint8_t *)"#K3ED84E527!", 12, resp, &database));
+}
+
+void test_cmdProcess_Tag(){ // Tags are echoed in the responses
+    CmdLink link;
+    uint8_t resp[24];
+    const uint8_t bCmd[] = {BIN_SYNC, 2, 'B' | CMD_TAG_FLAG, 0x1F, 0x31, 0x14};
+    const uint8_t bResp[] = {BIN_SYNC, 3, 'b' | CMD_TAG_FLAG, 0x1F, 0x09, 0x53, 0x29};
+    const uint8_t noTag[] = {BIN_SYNC, 1, 'B' | CMD_TAG_FLAG, 0xD7, 0x30};
+    const uint8_t hCmd[] = {BIN_SYNC, 2, 'H' | CMD_TAG_FLAG, 0x1F, 0xDE, 0xDF};
+    const uint8_t hResp[] = {BIN_SYNC, 3, ERR_SYM | CMD_TAG_FLAG, 0x1F, 0x03, 0xEE, 0xFC};    // UNKNOWN_CMD
+    const uint8_t pushTag[] = {BIN_SYNC, 2, 'B' | CMD_TAG_FLAG, CMD_PUSH_TAG, 0xCC, 0x3A};
+
+    cmdLinkInit(&link);
+    atomic_set(&database.io, 0x9 << RTDB_BUT_SHIFT);    // Buttons 1 and 4 pressed
+    atomic_and(&database.io, ~RTDB_LED_MASK);
+
+    TEST_ASSERT_EQUAL_INT(13, cmdProcess(&link, (const uint8_t *)"#@1FB249!", 9, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#@1Fb1001219!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(19, cmdProcess(&link, (const uint8_t *)"#@a0XBL3234!", 12, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#@A0xb01001l031125!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcess(&link, (const uint8_t *)"#@G1B250!", 9, resp, &database));
+    TEST_ASSERT_EQUAL_INT(10, cmdProcess(&link, (const uint8_t *)"#@1EB249!", 9, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#@1E?2039!", (char *)resp);     // Failures of tagged requests are answered
+    TEST_ASSERT_EQUAL_UINT32(1, link.stat[CMD_STAT_ERR - WRONG_CS - 100]);
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcess(&link, (const uint8_t *)"#@FFB014!", 9, resp, &database));    // Reserved for pushes
+
+    link.mode = CMD_MODE_BIN;
+    TEST_ASSERT_EQUAL_INT(sizeof(bResp), cmdProcess(&link, bCmd, sizeof(bCmd), resp, &database));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(bResp, resp, sizeof(bResp));
+    TEST_ASSERT_EQUAL_INT(INVALID_LEN, cmdProcess(&link, noTag, sizeof(noTag), resp, &database));
+    TEST_ASSERT_EQUAL_INT(sizeof(hResp), cmdProcess(&link, hCmd, sizeof(hCmd), resp, &database));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(hResp, resp, sizeof(hResp));
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcess(&link, pushTag, sizeof(pushTag), resp, &database));
+}
+
+void test_cmdPush(){ // Subscriptions push the changes of the buttons and of the analog input
+    CmdLink link;
+    uint8_t resp[20];
+
+    cmdLinkInit(&link);
+    atomic_set(&database.io, 0x9 << RTDB_BUT_SHIFT);    // Buttons 1 and 4 pressed
+    database.anRaw = 1021;
+    TEST_ASSERT_EQUAL_INT(0, cmdPush(&link, &database, 0, resp));
+
+    // Deadband of 10 and at most one push every 500 ms
+    TEST_ASSERT_EQUAL_INT(8, cmdProcess(&link, (const uint8_t *)"#W1100100500063!", 16, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#w11217!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(1, cmdPush(&link, &database, 1000, NULL));   // Only checked, still pending
+    TEST_ASSERT_EQUAL_INT(13, cmdPush(&link, &database, 1000, resp));
+    TEST_ASSERT_EQUAL_STRING("#@FFa1021241!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(0, cmdPush(&link, &database, 1000, resp));
+    database.anRaw = 1030;
+    TEST_ASSERT_EQUAL_INT(0, cmdPush(&link, &database, 2000, resp));
+    database.anRaw = 1040;
+    TEST_ASSERT_EQUAL_INT(0, cmdPush(&link, &database, 1200, resp));
+    TEST_ASSERT_EQUAL_INT(13, cmdPush(&link, &database, 1500, resp));
+    TEST_ASSERT_EQUAL_STRING("#@FFa1040242!", (char *)resp);
+
+    TEST_ASSERT_EQUAL_INT(8, cmdProcess(&link, (const uint8_t *)"#W0100000000056!", 16, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#w01216!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(13, cmdPush(&link, &database, 1500, resp));
+    TEST_ASSERT_EQUAL_STRING("#@FFb1001240!", (char *)resp);
+    atomic_set(&database.io, 0xB << RTDB_BUT_SHIFT);
+    TEST_ASSERT_EQUAL_INT(13, cmdPush(&link, &database, 1501, resp));
+    TEST_ASSERT_EQUAL_STRING("#@FFb1101241!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(0, cmdPush(&link, &database, 1502, resp));
+
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcess(&link, (const uint8_t *)"#W2100000000058!", 16, resp, &database));
+
+    // Negative samples near 0 V still honour the interval and the deadband
+    cmdLinkInit(&link);
+    database.anRaw = -3;
+    TEST_ASSERT_EQUAL_INT(8, cmdProcess(&link, (const uint8_t *)"#W1100100500063!", 16, resp, &database));
+    TEST_ASSERT_EQUAL_INT(13, cmdPush(&link, &database, 1000, resp));
+    TEST_ASSERT_EQUAL_STRING("#@FFa-003237!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(0, cmdPush(&link, &database, 1100, resp));
+    database.anRaw = -5;
+    TEST_ASSERT_EQUAL_INT(0, cmdPush(&link, &database, 2000, resp));
+}
+
+void test_cmdProcess_Stats(){ // Counters of the link read with the Q command
+    CmdLink link;
+    FrameDecoder dec;
+    FrameQueue q;
+    char cmd[FRAME_MAX_LEN];
+    uint8_t resp[40];
+    int len;
+
+    cmdLinkInit(&link);
+    frameDecoderInit(&dec, &link);
+    frameQueueInit(&q);
+
+    frameFeed(&dec, &q, (const uint8_t *)"#B066!xx#B067!", 14);
+    while((len = frameQueuePop(&q, cmd)) > 0){
+        cmdProcess(&link, (const uint8_t *)cmd, len, resp, &database);
+    }
+
+    TEST_ASSERT_EQUAL_INT(35, cmdProcess(&link, (const uint8_t *)"#Q00177!", 8, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#q00000000014000000002000000000232!", (char *)resp);
+    TEST_ASSERT_EQUAL_INT(35, cmdProcess(&link, (const uint8_t *)"#Q05182!", 8, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#q05000000000000000000000000001231!", (char *)resp);  // One WRONG_CS
+    TEST_ASSERT_EQUAL_INT(INVALID_ARG, cmdProcess(&link, (const uint8_t *)"#Q13181!", 8, resp, &database));
+    TEST_ASSERT_EQUAL_INT(35, cmdProcess(&link, (const uint8_t *)"#Q11179!", 8, resp, &database));
+    TEST_ASSERT_EQUAL_STRING("#q11000000000000000001000000000228!", (char *)resp);  // One INVALID_ARG
+}
+
+void test_rtdbRead(){ // Writers publish their updates through the sequence counter
+    RTDB snap;
+    char resp[20];
+
+    database.seq = 0;
+    database.anFreq = 100;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, cmdProcessor("#S1000020!", resp, &database));
+    TEST_ASSERT_EQUAL_UINT(2, database.seq);
+
+    rtdbRead(&database, &snap);
+    TEST_ASSERT_EQUAL_UINT(2, snap.seq);
+    TEST_ASSERT_EQUAL_INT(1000, snap.anFreq);
+}
+
+void test_storeCfgLoad(){ // Records written by this or an older firmware
+    StoreCfg cfg = {5000, AN_FREQ_DEFAULT, AN_MODE_SINGLE, 0};
+    StoreCfg rec = {2000000, 1000, AN_MODE_CONT, 0x5};
+    int32_t old = 3000000;              // Record with only the period
+
+    TEST_ASSERT_EQUAL_INT(1, storeCfgLoad(&cfg, &rec, sizeof(rec)));
+    TEST_ASSERT_EQUAL_MEMORY(&rec, &cfg, sizeof(cfg));
+
+    TEST_ASSERT_EQUAL_INT(1, storeCfgLoad(&cfg, &old, sizeof(old)));
+    TEST_ASSERT_EQUAL_INT(3000000, cfg.period);
+    TEST_ASSERT_EQUAL_INT(1000, cfg.anFreq);    // Kept
+    TEST_ASSERT_EQUAL_INT(0x5, cfg.leds);
+
+    rec.anFreq = 0;                     // Out of range, the whole record is ignored
+    TEST_ASSERT_EQUAL_INT(0, storeCfgLoad(&cfg, &rec, sizeof(rec)));
+    TEST_ASSERT_EQUAL_INT(3000000, cfg.period);
+}
+
 int main(void){
 
     UNITY_BEGIN();
@@ -89,9 +684,36 @@ int main(void){
     RUN_TEST(test_cmdProcessor_Lcmd);           // Tests for L command
     RUN_TEST(test_cmdProcessor_Acmd);           // Tests for A command 
     RUN_TEST(test_cmdProcessor_Ucmd);           // Tests for U command
+    RUN_TEST(test_cmdProcessor_Scmd);           // Tests for S command
+    RUN_TEST(test_cmdProcessor_Pcmd);           // Tests for P command
+    RUN_TEST(test_cmdProcessor_Rcmd);           // Tests for R command
+    RUN_TEST(test_cmdProcessor_Tcmd);           // Tests for T command
+    RUN_TEST(test_cmdProcessor_Ycmd);           // Tests for Y command
+    RUN_TEST(test_cmdProcessor_Icmd);           // Tests for I command
+    RUN_TEST(test_cmdProcessor_Dcmd);           // Tests for D command
     RUN_TEST(test_cmdProcessor_Checksum);       // Tests for the Checksum
+    RUN_TEST(test_cmdProcessor_ChecksumDigits); // Tests for the Checksum field format
+    RUN_TEST(test_cmdProcessor_Batch);          // Tests for batch frames
+    RUN_TEST(test_cmdProcessor_BatchRoom);
+    RUN_TEST(test_cmdRegister);                 // Tests for the opcode registry
     RUN_TEST(test_cmdProcessor_UnknownCommand); // Tests for command structure
     RUN_TEST(test_cmdProcessor_MissingSOF);     // Tests for commands without SOF
+    RUN_TEST(test_frameFeed_Split);             // Tests for the streaming decoder
+    RUN_TEST(test_frameFeed_Resync);
+    RUN_TEST(test_frameFeed_QueueFull);
+    RUN_TEST(test_frameFeed_Binary);
+    RUN_TEST(test_frameQueue_Peek);
+    RUN_TEST(test_frameQueue_Reserve);
+    RUN_TEST(test_cmdProcess_Binary);           // Tests for the binary protocol
+    RUN_TEST(test_cmdProcess_BinaryErrors);
+    RUN_TEST(test_cmdProcess_BinaryBatch);
+    RUN_TEST(test_crc);                         // Tests for the integrity checks
+    RUN_TEST(test_cmdProcess_Check);
+    RUN_TEST(test_cmdProcess_Tag);              // Tests for tagged requests
+    RUN_TEST(test_cmdPush);                     // Tests for the subscriptions
+    RUN_TEST(test_cmdProcess_Stats);            // Tests for the link counters
+    RUN_TEST(test_rtdbRead);                    // Tests for the RTDB snapshots
+    RUN_TEST(test_storeCfgLoad);                // Tests for the stored configuration
 
     UNITY_END();
 